@@ -4,12 +4,18 @@
 /* The gettext translation domain */
 #mesondefine GETTEXT_PACKAGE
 
+/* Define if memfd_create() is available */
+#mesondefine HAVE_MEMFD_CREATE
+
 /* Define if the xrandr-$XRANDR_REQUIRED library is present */
 #mesondefine HAVE_RANDR
 
 /* Building with startup notification support */
 #mesondefine HAVE_STARTUP_NOTIFICATION
 
+/* Define if the xrender library is present */
+#mesondefine HAVE_XRENDER
+
 /* Enable additional debugging at the expense of performance and size */
 #mesondefine MATE_ENABLE_DEBUG
 
@@ -19,6 +19,8 @@
  *
  * Author: Ray Strode <rstrode@redhat.com>
 */
+#include <config.h>
+
 #include <string.h>
 #include <math.h>
 #include <stdarg.h>
@@ -29,6 +31,9 @@
 #include <gdk/gdkx.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#ifdef HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
 #include <gtk/gtk.h>
 
 #include <cairo.h>
@@ -50,13 +55,32 @@ struct _MateBGCrossfadePrivate
     gdouble          start_time;
     gdouble          total_duration;
     guint            timeout_id;
+    guint            tick_id;
     guint            is_first_frame : 1;
+    guint            linear : 1;
+
+    /* what the fade repaints, in fading surface coordinates */
+    cairo_region_t  *damage;
+
+    /* surfaces of finished fades, to be painted over by the next one */
+    cairo_surface_t *spare_surfaces[3];
+
+#ifdef HAVE_XRENDER
+    /* root window fades are composited by the X server when possible,
+     * through a one pixel repeating mask holding the alpha */
+    Picture          fading_picture;
+    Picture          start_picture;
+    Picture          end_picture;
+    Picture          alpha_picture;
+    Pixmap           alpha_pixmap;
+#endif
 };
 
 enum {
     PROP_0,
     PROP_WIDTH,
     PROP_HEIGHT,
+    PROP_LINEAR,
 };
 
 enum {
@@ -88,6 +112,9 @@ mate_bg_crossfade_set_property (GObject      *object,
     case PROP_HEIGHT:
         fade->priv->height = g_value_get_int (value);
         break;
+    case PROP_LINEAR:
+        fade->priv->linear = g_value_get_boolean (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -114,6 +141,9 @@ mate_bg_crossfade_get_property (GObject    *object,
     case PROP_HEIGHT:
         g_value_set_int (value, fade->priv->height);
         break;
+    case PROP_LINEAR:
+        g_value_set_boolean (value, fade->priv->linear);
+        break;
 
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -125,6 +155,7 @@ static void
 mate_bg_crossfade_finalize (GObject *object)
 {
     MateBGCrossfade *fade;
+    guint i;
 
     fade = MATE_BG_CROSSFADE (object);
 
@@ -144,6 +175,18 @@ mate_bg_crossfade_finalize (GObject *object)
         cairo_surface_destroy (fade->priv->end_surface);
         fade->priv->end_surface = NULL;
     }
+
+    if (fade->priv->damage != NULL) {
+        cairo_region_destroy (fade->priv->damage);
+        fade->priv->damage = NULL;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (fade->priv->spare_surfaces); i++) {
+        if (fade->priv->spare_surfaces[i] != NULL) {
+            cairo_surface_destroy (fade->priv->spare_surfaces[i]);
+            fade->priv->spare_surfaces[i] = NULL;
+        }
+    }
 }
 
 static void
@@ -184,6 +227,22 @@ mate_bg_crossfade_class_init (MateBGCrossfadeClass *fade_class)
                                      0, G_MAXINT, 0,
                                      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE));
 
+    /**
+     * MateBGCrossfade:linear:
+     *
+     * Whether each frame of the crossfade is drawn from the start and
+     * end surfaces for the time elapsed, so that the fade is linear and
+     * takes the same time on any machine. Fades on widgets are then
+     * drawn in step with their frame clock. By default the frames are
+     * accumulated, which is cheaper but gives an exponential fade.
+     */
+    g_object_class_install_property (gobject_class,
+                                     PROP_LINEAR,
+                                     g_param_spec_boolean ("linear", "Linear",
+                                     "Whether to draw each frame for the time elapsed",
+                                     FALSE,
+                                     G_PARAM_READWRITE));
+
     /**
      * MateBGCrossfade::finished:
      * @fade: the #MateBGCrossfade that received the signal
@@ -211,6 +270,7 @@ mate_bg_crossfade_init (MateBGCrossfade *fade)
     fade->priv->start_surface = NULL;
     fade->priv->end_surface = NULL;
     fade->priv->timeout_id = 0;
+    fade->priv->tick_id = 0;
 }
 
 /**
@@ -235,8 +295,53 @@ MateBGCrossfade* mate_bg_crossfade_new (int width, int height)
     return (MateBGCrossfade*) object;
 }
 
+/* All the surfaces of a fade have its (construct only) size, so a spare
+ * one can stand in for any new surface of the same kind */
+static cairo_surface_t *
+take_spare_surface (MateBGCrossfade *fade,
+                    cairo_surface_t *similar)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (fade->priv->spare_surfaces); i++) {
+        cairo_surface_t *spare = fade->priv->spare_surfaces[i];
+
+        if (spare != NULL &&
+            cairo_surface_get_type (spare) == cairo_surface_get_type (similar) &&
+            cairo_surface_get_content (spare) == cairo_surface_get_content (similar) &&
+            cairo_surface_get_device (spare) == cairo_surface_get_device (similar)) {
+            fade->priv->spare_surfaces[i] = NULL;
+            return spare;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+release_surface (MateBGCrossfade  *fade,
+                 cairo_surface_t **surface)
+{
+    guint i;
+
+    if (*surface == NULL)
+        return;
+
+    for (i = 0; i < G_N_ELEMENTS (fade->priv->spare_surfaces); i++) {
+        if (fade->priv->spare_surfaces[i] == NULL) {
+            fade->priv->spare_surfaces[i] = *surface;
+            *surface = NULL;
+            return;
+        }
+    }
+
+    cairo_surface_destroy (*surface);
+    *surface = NULL;
+}
+
 static cairo_surface_t *
-tile_surface (cairo_surface_t *surface,
+tile_surface (MateBGCrossfade *fade,
+              cairo_surface_t *surface,
               int              width,
               int              height)
 {
@@ -251,12 +356,16 @@ tile_surface (cairo_surface_t *surface,
     }
     else
     {
-        copy = cairo_surface_create_similar (surface,
-                                             cairo_surface_get_content (surface),
-                                             width, height);
+        copy = take_spare_surface (fade, surface);
+        if (copy == NULL)
+            copy = cairo_surface_create_similar (surface,
+                                                 cairo_surface_get_content (surface),
+                                                 width, height);
     }
 
     cr = cairo_create (copy);
+    /* a spare surface still holds its old contents */
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
 
     if (surface != NULL)
     {
@@ -313,46 +422,23 @@ mate_bg_crossfade_set_start_surface (MateBGCrossfade* fade, cairo_surface_t *sur
 {
     g_return_val_if_fail (MATE_IS_BG_CROSSFADE (fade), FALSE);
 
-    if (fade->priv->start_surface != NULL)
-    {
-        cairo_surface_destroy (fade->priv->start_surface);
-        fade->priv->start_surface = NULL;
-    }
+    release_surface (fade, &fade->priv->start_surface);
 
-    fade->priv->start_surface = tile_surface (surface,
+    fade->priv->start_surface = tile_surface (fade, surface,
                                               fade->priv->width,
                                               fade->priv->height);
 
     return fade->priv->start_surface != NULL;
 }
 
-#if GLIB_CHECK_VERSION(2,61,2)
-static gdouble
-get_current_time (void)
-{
-    const double microseconds_per_second = (double) G_USEC_PER_SEC;
-    gint64 tv;
-
-    tv = g_get_real_time ();
-
-    return (double) (tv / microseconds_per_second);
-}
-#else
+/* Same clock as gdk_frame_clock_get_frame_time() */
 static gdouble
 get_current_time (void)
 {
     const double microseconds_per_second = (double) G_USEC_PER_SEC;
-    double timestamp;
-    GTimeVal now;
 
-    g_get_current_time (&now);
-
-    timestamp = ((microseconds_per_second * now.tv_sec) + now.tv_usec) /
-                microseconds_per_second;
-
-    return timestamp;
+    return (double) g_get_monotonic_time () / microseconds_per_second;
 }
-#endif
 
 /**
  * mate_bg_crossfade_set_end_surface:
@@ -371,12 +457,9 @@ mate_bg_crossfade_set_end_surface (MateBGCrossfade* fade, cairo_surface_t *surfa
 {
     g_return_val_if_fail (MATE_IS_BG_CROSSFADE (fade), FALSE);
 
-    if (fade->priv->end_surface != NULL) {
-        cairo_surface_destroy (fade->priv->end_surface);
-        fade->priv->end_surface = NULL;
-    }
+    release_surface (fade, &fade->priv->end_surface);
 
-    fade->priv->end_surface = tile_surface (surface,
+    fade->priv->end_surface = tile_surface (fade, surface,
                                             fade->priv->width,
                                             fade->priv->height);
 
@@ -418,17 +501,222 @@ send_root_property_change_notification (MateBGCrossfade *fade)
                          (unsigned char *) &zero_length_pixmap, 0);
 }
 
+#ifdef HAVE_XRENDER
+static Picture
+create_picture_for_surface (Display         *xdisplay,
+                            cairo_surface_t *surface)
+{
+    XRenderPictFormat *format;
+    Visual *visual;
+
+    if (cairo_surface_get_type (surface) != CAIRO_SURFACE_TYPE_XLIB ||
+        cairo_xlib_surface_get_display (surface) != xdisplay)
+        return None;
+
+    visual = cairo_xlib_surface_get_visual (surface);
+    if (visual != NULL)
+        format = XRenderFindVisualFormat (xdisplay, visual);
+    else if (cairo_xlib_surface_get_depth (surface) == 32)
+        format = XRenderFindStandardFormat (xdisplay, PictStandardARGB32);
+    else if (cairo_xlib_surface_get_depth (surface) == 24)
+        format = XRenderFindStandardFormat (xdisplay, PictStandardRGB24);
+    else
+        format = NULL;
+
+    if (format == NULL)
+        return None;
+
+    cairo_surface_flush (surface);
+
+    return XRenderCreatePicture (xdisplay,
+                                 cairo_xlib_surface_get_drawable (surface),
+                                 format, 0, NULL);
+}
+
+static void
+free_pictures (MateBGCrossfade *fade)
+{
+    Display *xdisplay;
+    GdkDisplay *display;
+
+    if (fade->priv->fading_picture == None &&
+        fade->priv->alpha_pixmap == None)
+        return;
+
+    display = gdk_window_get_display (fade->priv->window);
+    xdisplay = GDK_DISPLAY_XDISPLAY (display);
+
+    gdk_x11_display_error_trap_push (display);
+
+    if (fade->priv->fading_picture != None)
+        XRenderFreePicture (xdisplay, fade->priv->fading_picture);
+    if (fade->priv->start_picture != None)
+        XRenderFreePicture (xdisplay, fade->priv->start_picture);
+    if (fade->priv->end_picture != None)
+        XRenderFreePicture (xdisplay, fade->priv->end_picture);
+    if (fade->priv->alpha_picture != None)
+        XRenderFreePicture (xdisplay, fade->priv->alpha_picture);
+    if (fade->priv->alpha_pixmap != None)
+        XFreePixmap (xdisplay, fade->priv->alpha_pixmap);
+
+    gdk_x11_display_error_trap_pop_ignored (display);
+
+    fade->priv->fading_picture = None;
+    fade->priv->start_picture = None;
+    fade->priv->end_picture = None;
+    fade->priv->alpha_picture = None;
+    fade->priv->alpha_pixmap = None;
+
+    /* the root pixmap changed behind cairo's back */
+    cairo_surface_mark_dirty (fade->priv->fading_surface);
+}
+
+/* Sets up compositing a root window fade in the X server. If that is
+ * not possible, frames are drawn with cairo.
+ */
+static void
+create_pictures (MateBGCrossfade *fade)
+{
+    XRenderPictureAttributes attributes;
+    Display *xdisplay;
+    GdkDisplay *display;
+    int event_base, error_base;
+
+    display = gdk_window_get_display (fade->priv->window);
+    xdisplay = GDK_DISPLAY_XDISPLAY (display);
+
+    if (!XRenderQueryExtension (xdisplay, &event_base, &error_base))
+        return;
+
+    gdk_x11_display_error_trap_push (display);
+
+    fade->priv->fading_picture = create_picture_for_surface (xdisplay,
+                                                             fade->priv->fading_surface);
+    fade->priv->start_picture = create_picture_for_surface (xdisplay,
+                                                            fade->priv->start_surface);
+    fade->priv->end_picture = create_picture_for_surface (xdisplay,
+                                                          fade->priv->end_surface);
+
+    fade->priv->alpha_pixmap = XCreatePixmap (xdisplay,
+                                              GDK_WINDOW_XID (fade->priv->window),
+                                              1, 1, 8);
+    attributes.repeat = True;
+    fade->priv->alpha_picture = XRenderCreatePicture (xdisplay,
+                                                      fade->priv->alpha_pixmap,
+                                                      XRenderFindStandardFormat (xdisplay, PictStandardA8),
+                                                      CPRepeat, &attributes);
+
+    if (gdk_x11_display_error_trap_pop (display) != 0 ||
+        fade->priv->fading_picture == None ||
+        fade->priv->start_picture == None ||
+        fade->priv->end_picture == None ||
+        fade->priv->alpha_picture == None)
+        free_pictures (fade);
+}
+
+static void
+composite_frame (MateBGCrossfade *fade,
+                 gdouble          percent_done)
+{
+    Display *xdisplay;
+    XRenderColor alpha = { 0, 0, 0, 0 };
+    int i, n_rects;
+
+    xdisplay = GDK_WINDOW_XDISPLAY (fade->priv->window);
+
+    alpha.alpha = (unsigned short) (percent_done * 0xffff);
+    XRenderFillRectangle (xdisplay, PictOpSrc, fade->priv->alpha_picture,
+                          &alpha, 0, 0, 1, 1);
+
+    n_rects = cairo_region_num_rectangles (fade->priv->damage);
+    for (i = 0; i < n_rects; i++) {
+        cairo_rectangle_int_t rect;
+
+        cairo_region_get_rectangle (fade->priv->damage, i, &rect);
+
+        if (fade->priv->linear)
+            XRenderComposite (xdisplay, PictOpSrc,
+                              fade->priv->start_picture, None,
+                              fade->priv->fading_picture,
+                              rect.x, rect.y, 0, 0, rect.x, rect.y,
+                              rect.width, rect.height);
+
+        XRenderComposite (xdisplay, PictOpOver,
+                          fade->priv->end_picture, fade->priv->alpha_picture,
+                          fade->priv->fading_picture,
+                          rect.x, rect.y, 0, 0, rect.x, rect.y,
+                          rect.width, rect.height);
+    }
+}
+#endif
+
+/* The monitors the window shows, in the pixels of what is painted */
+static cairo_region_t *
+get_damage_region (MateBGCrossfade *fade)
+{
+    GdkDisplay *display;
+    cairo_region_t *region;
+    GdkRectangle bounds;
+    int n_monitors, i;
+    int x, y, scale;
+
+    display = gdk_window_get_display (fade->priv->window);
+    n_monitors = gdk_display_get_n_monitors (display);
+    gdk_window_get_origin (fade->priv->window, &x, &y);
+
+    /* the root pixmap is in device pixels */
+    if (gdk_window_get_window_type (fade->priv->window) == GDK_WINDOW_ROOT)
+        scale = gdk_window_get_scale_factor (fade->priv->window);
+    else
+        scale = 1;
+
+    bounds.x = 0;
+    bounds.y = 0;
+    bounds.width = fade->priv->width;
+    bounds.height = fade->priv->height;
+
+    region = cairo_region_create ();
+
+    for (i = 0; i < n_monitors; i++) {
+        GdkRectangle rect;
+
+        gdk_monitor_get_geometry (gdk_display_get_monitor (display, i), &rect);
+        rect.x -= x;
+        rect.y -= y;
+
+        if (!gdk_rectangle_intersect (&rect, &bounds, &rect))
+            continue;
+
+        rect.x *= scale;
+        rect.y *= scale;
+        rect.width *= scale;
+        rect.height *= scale;
+        cairo_region_union_rectangle (region, &rect);
+    }
+
+    return region;
+}
+
 static void
 draw_background (MateBGCrossfade *fade)
 {
+    if (cairo_region_is_empty (fade->priv->damage))
+        return;
+
     if (fade->priv->widget != NULL) {
-        gtk_widget_queue_draw (fade->priv->widget);
+        gtk_widget_queue_draw_region (fade->priv->widget, fade->priv->damage);
     } else if (gdk_window_get_window_type (fade->priv->window) != GDK_WINDOW_ROOT) {
         cairo_t           *cr;
         cairo_region_t    *region;
         GdkDrawingContext *draw_context;
 
         region = gdk_window_get_visible_region (fade->priv->window);
+        cairo_region_intersect (region, fade->priv->damage);
+        if (cairo_region_is_empty (region)) {
+            cairo_region_destroy (region);
+            return;
+        }
+
         draw_context = gdk_window_begin_draw_frame (fade->priv->window,
                                                     region);
         cr = gdk_drawing_context_get_cairo_context (draw_context);
@@ -440,13 +728,31 @@ draw_background (MateBGCrossfade *fade)
     } else {
         Display *xdisplay = GDK_WINDOW_XDISPLAY (fade->priv->window);
         GdkDisplay *display;
+        int i, n_rects;
+
         display = gdk_display_get_default ();
         gdk_x11_display_error_trap_push (display);
-        XGrabServer (xdisplay);
-        XClearWindow (xdisplay, GDK_WINDOW_XID (fade->priv->window));
+
+        /* the server does the frames in order without being held */
+#ifdef HAVE_XRENDER
+        if (fade->priv->fading_picture == None)
+#endif
+            XGrabServer (xdisplay);
+
+        n_rects = cairo_region_num_rectangles (fade->priv->damage);
+        for (i = 0; i < n_rects; i++) {
+            cairo_rectangle_int_t rect;
+
+            cairo_region_get_rectangle (fade->priv->damage, i, &rect);
+            XClearArea (xdisplay, GDK_WINDOW_XID (fade->priv->window),
+                        rect.x, rect.y, rect.width, rect.height, False);
+        }
         send_root_property_change_notification (fade);
         XFlush (xdisplay);
-        XUngrabServer (xdisplay);
+#ifdef HAVE_XRENDER
+        if (fade->priv->fading_picture == None)
+#endif
+            XUngrabServer (xdisplay);
         gdk_x11_display_error_trap_pop_ignored (display);
     }
 }
@@ -466,16 +772,13 @@ on_widget_draw (GtkWidget       *widget,
 }
 
 static gboolean
-on_tick (MateBGCrossfade *fade)
+draw_frame (MateBGCrossfade *fade,
+            gdouble          now)
 {
-    gdouble now, percent_done;
+    gdouble percent_done;
     cairo_t *cr;
     cairo_status_t status;
 
-    g_return_val_if_fail (MATE_IS_BG_CROSSFADE (fade), FALSE);
-
-    now = get_current_time ();
-
     percent_done = (now - fade->priv->start_time) / fade->priv->total_duration;
     percent_done = CLAMP (percent_done, 0.0, 1.0);
 
@@ -483,10 +786,11 @@ on_tick (MateBGCrossfade *fade)
      * then lengthen the duration, so the user will get to see
      * the effect.
      */
-    if (fade->priv->is_first_frame && percent_done > .33) {
+    if (!fade->priv->linear &&
+        fade->priv->is_first_frame && percent_done > .33) {
         fade->priv->is_first_frame = FALSE;
         fade->priv->total_duration *= 1.5;
-        return on_tick (fade);
+        return draw_frame (fade, now);
     }
 
     if (fade->priv->fading_surface == NULL ||
@@ -498,7 +802,25 @@ on_tick (MateBGCrossfade *fade)
         return FALSE;
     }
 
-    /* We accumulate the results in place for performance reasons.
+    /* no monitor shows the window */
+    if (cairo_region_is_empty (fade->priv->damage)) {
+        return FALSE;
+    }
+
+#ifdef HAVE_XRENDER
+    if (fade->priv->fading_picture != None) {
+        composite_frame (fade, percent_done);
+        draw_background (fade);
+
+        if (fade->priv->linear)
+            return percent_done < 1.0;
+
+        return percent_done <= .99;
+    }
+#endif
+
+    /* Unless the fade is linear, we accumulate the results in place for
+     * performance reasons.
      *
      * This means 1) The fade is exponential, not linear (looks good!)
      * 2) The rate of fade is not independent of frame rate. Slower machines
@@ -508,6 +830,17 @@ on_tick (MateBGCrossfade *fade)
      */
     cr = cairo_create (fade->priv->fading_surface);
 
+    gdk_cairo_region (cr, fade->priv->damage);
+    cairo_clip (cr);
+
+    if (fade->priv->linear) {
+        cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface (cr, fade->priv->start_surface,
+                                  0.0, 0.0);
+        cairo_paint (cr);
+        cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+    }
+
     cairo_set_source_surface (cr, fade->priv->end_surface,
                               0.0, 0.0);
     cairo_paint_with_alpha (cr, percent_done);
@@ -518,36 +851,75 @@ on_tick (MateBGCrossfade *fade)
     if (status == CAIRO_STATUS_SUCCESS) {
         draw_background (fade);
     }
+
+    if (fade->priv->linear)
+        return percent_done < 1.0;
+
     return percent_done <= .99;
 }
 
+static gboolean
+on_tick (MateBGCrossfade *fade)
+{
+    g_return_val_if_fail (MATE_IS_BG_CROSSFADE (fade), FALSE);
+
+    return draw_frame (fade, get_current_time ());
+}
+
+/* Frames that are late are simply skipped: the next one is drawn for
+ * the time it will be shown at */
+static gboolean
+on_frame_clock_tick (GtkWidget     *widget,
+                     GdkFrameClock *frame_clock,
+                     gpointer       user_data)
+{
+    MateBGCrossfade *fade = user_data;
+    gdouble now;
+
+    g_return_val_if_fail (MATE_IS_BG_CROSSFADE (fade), G_SOURCE_REMOVE);
+
+    now = (gdouble) gdk_frame_clock_get_frame_time (frame_clock) / G_USEC_PER_SEC;
+
+    return draw_frame (fade, now) ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
 static void
 on_finished (MateBGCrossfade *fade)
 {
     cairo_t *cr;
 
-    if (fade->priv->timeout_id == 0)
+    if (fade->priv->timeout_id == 0 && fade->priv->tick_id == 0)
         return;
 
     g_assert (fade->priv->fading_surface != NULL);
     g_assert (fade->priv->end_surface != NULL);
 
+#ifdef HAVE_XRENDER
+    free_pictures (fade);
+#endif
+
     cr = cairo_create (fade->priv->fading_surface);
     cairo_set_source_surface (cr, fade->priv->end_surface, 0, 0);
     cairo_paint (cr);
     cairo_destroy (cr);
     draw_background (fade);
 
-    cairo_surface_destroy (fade->priv->fading_surface);
-    fade->priv->fading_surface = NULL;
+    cairo_region_destroy (fade->priv->damage);
+    fade->priv->damage = NULL;
 
-    cairo_surface_destroy (fade->priv->end_surface);
-    fade->priv->end_surface = NULL;
+    /* the root pixmap is not ours to reuse */
+    if (gdk_window_get_window_type (fade->priv->window) == GDK_WINDOW_ROOT) {
+        cairo_surface_destroy (fade->priv->fading_surface);
+        fade->priv->fading_surface = NULL;
+    } else {
+        release_surface (fade, &fade->priv->fading_surface);
+    }
+
+    release_surface (fade, &fade->priv->end_surface);
 
     g_assert (fade->priv->start_surface != NULL);
 
-    cairo_surface_destroy (fade->priv->start_surface);
-    fade->priv->start_surface = NULL;
+    release_surface (fade, &fade->priv->start_surface);
 
     if (fade->priv->widget != NULL) {
         g_signal_handlers_disconnect_by_func (fade->priv->widget,
@@ -557,6 +929,7 @@ on_finished (MateBGCrossfade *fade)
     fade->priv->widget = NULL;
 
     fade->priv->timeout_id = 0;
+    fade->priv->tick_id = 0;
     g_signal_emit (fade, signals[FINISHED], 0, fade->priv->window);
 }
 
@@ -665,7 +1038,8 @@ mate_bg_crossfade_start (MateBGCrossfade *fade,
 
     fade->priv->window = window;
     if (gdk_window_get_window_type (fade->priv->window) != GDK_WINDOW_ROOT) {
-        fade->priv->fading_surface = tile_surface (fade->priv->start_surface,
+        fade->priv->fading_surface = tile_surface (fade,
+                                                   fade->priv->start_surface,
                                                    fade->priv->width,
                                                    fade->priv->height);
         if (fade->priv->widget != NULL) {
@@ -681,17 +1055,34 @@ mate_bg_crossfade_start (MateBGCrossfade *fade,
         cairo_set_source_surface (cr, fade->priv->start_surface, 0, 0);
         cairo_paint (cr);
         cairo_destroy (cr);
+
+#ifdef HAVE_XRENDER
+        create_pictures (fade);
+#endif
     }
+
+    if (fade->priv->damage != NULL)
+        cairo_region_destroy (fade->priv->damage);
+    fade->priv->damage = get_damage_region (fade);
+
     draw_background (fade);
 
-    source = g_timeout_source_new (1000 / 60.0);
-    g_source_set_callback (source,
-                           (GSourceFunc) on_tick,
-                           fade,
-                           (GDestroyNotify) on_finished);
-    context = g_main_context_default ();
-    fade->priv->timeout_id = g_source_attach (source, context);
-    g_source_unref (source);
+    /* The root window has no frame clock to follow */
+    if (fade->priv->linear && fade->priv->widget != NULL) {
+        fade->priv->tick_id = gtk_widget_add_tick_callback (fade->priv->widget,
+                                                            on_frame_clock_tick,
+                                                            fade,
+                                                            (GDestroyNotify) on_finished);
+    } else {
+        source = g_timeout_source_new (1000 / 60.0);
+        g_source_set_callback (source,
+                               (GSourceFunc) on_tick,
+                               fade,
+                               (GDestroyNotify) on_finished);
+        context = g_main_context_default ();
+        fade->priv->timeout_id = g_source_attach (source, context);
+        g_source_unref (source);
+    }
 
     fade->priv->is_first_frame = TRUE;
     fade->priv->total_duration = .75;
@@ -741,7 +1132,7 @@ mate_bg_crossfade_is_started (MateBGCrossfade *fade)
 {
     g_return_val_if_fail (MATE_IS_BG_CROSSFADE (fade), FALSE);
 
-    return fade->priv->timeout_id != 0;
+    return fade->priv->timeout_id != 0 || fade->priv->tick_id != 0;
 }
 
 /**
@@ -760,7 +1151,14 @@ mate_bg_crossfade_stop (MateBGCrossfade *fade)
     if (!mate_bg_crossfade_is_started (fade))
         return;
 
-    g_assert (fade->priv->timeout_id != 0);
-    g_source_remove (fade->priv->timeout_id);
+    /* either calls on_finished() */
+    if (fade->priv->tick_id != 0) {
+        gtk_widget_remove_tick_callback (fade->priv->widget,
+                                         fade->priv->tick_id);
+    } else {
+        g_assert (fade->priv->timeout_id != 0);
+        g_source_remove (fade->priv->timeout_id);
+    }
     fade->priv->timeout_id = 0;
+    fade->priv->tick_id = 0;
 }
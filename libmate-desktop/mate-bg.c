@@ -30,10 +30,14 @@ Authors: Soren Sandmann <sandmann@redhat.com>
 
 */
 
+#include <errno.h>
 #include <string.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 
 #include <glib/gstdio.h>
 #include <gio/gio.h>
@@ -44,6 +48,17 @@ Authors: Soren Sandmann <sandmann@redhat.com>
 
 #include <cairo.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* AVX2 code paths are compiled in with the target attribute and only used
+ * when the CPU supports them */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATE_BG_AVX2_DISPATCH 1
+#include <immintrin.h>
+#endif
+
 #define MATE_DESKTOP_USE_UNSTABLE_API
 #include <mate-bg.h>
 #include <mate-bg-crossfade.h>
@@ -61,6 +76,7 @@ typedef struct _Slide Slide;
 
 struct _Slide {
 	double duration; /* in seconds */
+	double step; /* how often to redraw it, see slideshow_build_index() */
 	gboolean fixed;
 
 	GSList* file1;
@@ -78,7 +94,22 @@ struct _FileSize {
 #define THUMBNAIL_SIZE 256
 
 typedef struct FileCacheEntry FileCacheEntry;
-#define CACHE_SIZE 4
+
+/* Default upper bound, in bytes, for the decoded data kept in the
+ * per-MateBG file cache. The most recently used entry is always kept,
+ * even if it alone exceeds the budget. */
+#define CACHE_BUDGET_DEFAULT (128 * 1024 * 1024)
+
+/* What the drawing code needs to know about the background file. It is
+ * looked up once, then again only when the file monitor reports a change,
+ * so that redraws do not have to stat the file: see get_file_stat(). */
+typedef struct {
+	guint    generation;
+	gboolean exists;
+	gboolean is_image;	/* a single image, not a slideshow */
+	gint64   mtime;
+	gint64   size;
+} FileStat;
 
 /*
  *   Implementation of the MateBG class
@@ -100,11 +131,36 @@ struct _MateBG {
 
 	/* Cached information, only access through cache accessor functions */
 	SlideShow* slideshow;
-	gint64 file_mtime;
+	gint64 file_mtime; /* only kept if the file could not be monitored */
+	guint file_generation; /* bumped on every change of the file */
+	FileStat file_stat;
 	GdkPixbuf* pixbuf_cache;
+	char *pixbuf_cache_source; /* NULL for transition frames */
 	int timeout_id;
 
-	GList* file_cache;
+	GHashTable* file_cache;
+	GQueue file_cache_lru; /* most recently used first */
+	gsize file_cache_bytes;
+	gsize file_cache_budget;
+	guint file_cache_hits;
+	guint file_cache_misses;
+	guint file_cache_evictions;
+
+	/* Prefetching of the next slideshow frame */
+	guint prefetch_id;
+	double prefetch_time;
+	GArray *prefetch_sizes;
+	GCancellable *prefetch_cancellable;
+
+	/* Buffers reused between the frames of slideshow transitions */
+	GPtrArray *transitions;
+
+	/* Maximum number of threads drawing the monitors, 0 for automatic */
+	guint max_render_threads;
+
+	/* TRUE for the private copies rendered by a worker thread, see
+	 * mate_bg_create_surface_async(); these never touch the main loop */
+	gboolean render_copy;
 };
 
 struct _MateBGClass {
@@ -124,9 +180,11 @@ G_DEFINE_TYPE(MateBG, mate_bg, G_TYPE_OBJECT)
 static cairo_surface_t *make_root_pixmap     (GdkWindow  *window,
                                               gint        width,
                                               gint        height);
+static cairo_surface_t *surface_from_pixbuf  (GdkPixbuf  *pixbuf);
 
 /* Pixbuf utils */
 static void       pixbuf_average_value (GdkPixbuf  *pixbuf,
+					gsize       max_samples,
                                         GdkRGBA    *result);
 static GdkPixbuf *pixbuf_scale_to_fit  (GdkPixbuf  *src,
 					int         max_width,
@@ -141,6 +199,12 @@ static void       pixbuf_draw_gradient (GdkPixbuf    *pixbuf,
 					GdkRGBA     *c2,
 					GdkRectangle *rect);
 
+static gboolean   pixbuf_can_lerp      (GdkPixbuf  *p1,
+					GdkPixbuf  *p2);
+static void       pixbuf_lerp          (GdkPixbuf  *p1,
+					GdkPixbuf  *p2,
+					GdkPixbuf  *dest,
+					double      alpha);
 static void       pixbuf_tile          (GdkPixbuf  *src,
 					GdkPixbuf  *dest);
 static void       pixbuf_blend         (GdkPixbuf  *src,
@@ -166,6 +230,19 @@ static GdkPixbuf *get_pixbuf_for_size  (MateBG               *bg,
 					int                   width,
 					int                   height);
 static void       clear_cache          (MateBG               *bg);
+static gpointer   file_cache_lookup_scaled (MateBG           *bg,
+					    const char       *filename,
+					    gint              width,
+					    gint              height,
+					    gboolean          surface);
+static void       file_cache_add_scaled (MateBG               *bg,
+					 const char           *filename,
+					 gint                  width,
+					 gint                  height,
+					 gpointer              image,
+					 gboolean              surface);
+static void       load_disk_cache_settings (GSettings        *settings);
+static void       shared_pixbuf_forget (const char            *filename);
 static gboolean   is_different         (MateBG               *bg,
 					const char            *filename);
 static gint64     get_mtime            (const char            *filename);
@@ -177,14 +254,26 @@ static GdkPixbuf *create_img_thumbnail (MateBG               *bg,
 					int		       frame_num);
 static SlideShow * get_as_slideshow    (MateBG               *bg,
 					const char 	      *filename);
+static SlideShow * peek_slideshow      (MateBG               *bg,
+					const char            *filename);
+static void        file_cache_add_slide_show (MateBG         *bg,
+					      const char     *filename,
+					      SlideShow      *show);
+static void        file_cache_adopt_pixbufs (MateBG          *bg,
+					     MateBG          *from);
+static GPtrArray * transitions_copy    (MateBG               *bg);
+static void        ensure_timeout      (MateBG               *bg,
+					double                 timeout);
 static Slide *     get_current_slide   (SlideShow 	      *show,
-		   			double    	      *alpha);
+		   			double    	      *alpha,
+					double                *next_change);
 static gboolean    slideshow_has_multiple_sizes (SlideShow *show);
 
 static SlideShow *read_slideshow_file (const char *filename,
 				       GError     **err);
 static SlideShow *slideshow_ref       (SlideShow  *show);
 static void       slideshow_unref     (SlideShow  *show);
+static gsize      slideshow_get_size  (SlideShow  *show);
 
 static FileSize   *find_best_size      (GSList                *sizes,
 					gint                   width,
@@ -391,6 +480,9 @@ mate_bg_load_from_gsettings (MateBG    *bg,
 	/* Placement */
 	placement = g_settings_get_enum (settings, MATE_BG_KEY_PICTURE_PLACEMENT);
 
+	/* Disk cache, shared by all the MateBG of the process */
+	load_disk_cache_settings (settings);
+
 	mate_bg_set_color (bg, ctype, &c1, &c2);
 	mate_bg_set_placement (bg, placement);
 	mate_bg_set_filename (bg, filename);
@@ -437,9 +529,22 @@ mate_bg_save_to_gsettings (MateBG    *bg,
 	g_free (secondary);
 }
 
+static guint     file_cache_entry_hash   (gconstpointer  key);
+static gboolean  file_cache_entry_equal  (gconstpointer  a,
+					  gconstpointer  b);
+static void      file_cache_entry_delete (FileCacheEntry *ent);
+static void      bound_cache             (MateBG        *bg);
+
 static void
 mate_bg_init (MateBG *bg)
 {
+	bg->file_cache = g_hash_table_new_full (file_cache_entry_hash,
+						file_cache_entry_equal,
+						NULL,
+						(GDestroyNotify) file_cache_entry_delete);
+	g_queue_init (&bg->file_cache_lru);
+	bg->file_cache_budget = CACHE_BUDGET_DEFAULT;
+	bg->file_generation = 1;
 }
 
 static void
@@ -480,6 +585,12 @@ mate_bg_finalize (GObject *object)
 	g_free (bg->filename);
 	bg->filename = NULL;
 
+	g_free (bg->pixbuf_cache_source);
+	bg->pixbuf_cache_source = NULL;
+
+	g_hash_table_destroy (bg->file_cache);
+	bg->file_cache = NULL;
+
 	G_OBJECT_CLASS (mate_bg_parent_class)->finalize (object);
 }
 
@@ -604,288 +715,1224 @@ mate_bg_get_filename (MateBG *bg)
 	return bg->filename;
 }
 
-static inline gchar *
-get_wallpaper_cache_dir (void)
+/**
+ * mate_bg_set_cache_budget:
+ * @bg: a #MateBG
+ * @budget: maximum number of bytes of decoded images to keep cached
+ *
+ * Sets how much memory @bg may use for caching decoded images and
+ * slideshows. Least recently used entries are dropped once the budget
+ * is exceeded. The most recently used entry is always kept.
+ **/
+void
+mate_bg_set_cache_budget (MateBG *bg,
+			  gsize   budget)
 {
-	return g_build_filename (g_get_user_cache_dir(), MATE_BG_CACHE_DIR, NULL);
+	g_return_if_fail (MATE_IS_BG (bg));
+
+	bg->file_cache_budget = budget;
+	bound_cache (bg);
 }
 
-static inline gchar *
-get_wallpaper_cache_prefix_name (gint                     num_monitor,
-				 MateBGPlacement          placement,
-				 gint                     width,
-				 gint                     height)
+/**
+ * mate_bg_get_cache_budget:
+ * @bg: a #MateBG
+ *
+ * Returns: the cache budget of @bg in bytes, see mate_bg_set_cache_budget()
+ **/
+gsize
+mate_bg_get_cache_budget (MateBG *bg)
 {
-	return g_strdup_printf ("%i_%i_%i_%i", num_monitor, (gint) placement, width, height);
+	g_return_val_if_fail (MATE_IS_BG (bg), 0);
+
+	return bg->file_cache_budget;
 }
 
-static char *
-get_wallpaper_cache_filename (const char              *filename,
-			      gint                     num_monitor,
-			      MateBGPlacement          placement,
-			      gint                     width,
-			      gint                     height)
-{
-	gchar *cache_filename;
-	gchar *cache_prefix_name;
-	gchar *md5_filename;
-	gchar *cache_basename;
-	gchar *cache_dir;
+/**
+ * mate_bg_get_cache_stats:
+ * @bg: a #MateBG
+ * @hits: (out) (allow-none): return location for the number of cache hits
+ * @misses: (out) (allow-none): return location for the number of cache misses
+ * @evictions: (out) (allow-none): return location for the number of entries
+ *   dropped to stay within the cache budget
+ *
+ * Retrieves counters describing how well the image cache of @bg performs.
+ **/
+void
+mate_bg_get_cache_stats (MateBG *bg,
+			 guint  *hits,
+			 guint  *misses,
+			 guint  *evictions)
+{
+	g_return_if_fail (MATE_IS_BG (bg));
 
-	md5_filename = g_compute_checksum_for_data (G_CHECKSUM_MD5, (const guchar *) filename,
-						    strlen (filename));
-	cache_prefix_name = get_wallpaper_cache_prefix_name (num_monitor, placement, width, height);
-	cache_basename = g_strdup_printf ("%s_%s", cache_prefix_name, md5_filename);
-	cache_dir = get_wallpaper_cache_dir ();
-	cache_filename = g_build_filename (cache_dir, cache_basename, NULL);
+	if (hits)
+		*hits = bg->file_cache_hits;
 
-	g_free (cache_prefix_name);
-	g_free (md5_filename);
-	g_free (cache_basename);
-	g_free (cache_dir);
+	if (misses)
+		*misses = bg->file_cache_misses;
+
+	if (evictions)
+		*evictions = bg->file_cache_evictions;
+}
+
+/**
+ * mate_bg_set_max_render_threads:
+ * @bg: a #MateBG
+ * @max_threads: maximum number of threads, or 0 for one per processor
+ *
+ * Sets how many threads may be used to draw the monitors in parallel.
+ * Use 1 to always draw them one after the other on the calling thread.
+ **/
+void
+mate_bg_set_max_render_threads (MateBG *bg,
+				guint   max_threads)
+{
+	g_return_if_fail (MATE_IS_BG (bg));
+
+	bg->max_render_threads = max_threads;
+}
 
-	return cache_filename;
+/**
+ * mate_bg_get_max_render_threads:
+ * @bg: a #MateBG
+ *
+ * Return value: the maximum number of threads used to draw the monitors,
+ * as set by mate_bg_set_max_render_threads().
+ **/
+guint
+mate_bg_get_max_render_threads (MateBG *bg)
+{
+	g_return_val_if_fail (MATE_IS_BG (bg), 0);
+
+	return bg->max_render_threads;
 }
 
 static void
-cleanup_cache_for_monitor (gchar *cache_dir,
-			   gint   num_monitor)
+file_stat_query (const char *filename,
+		 FileStat   *stat)
 {
-	GDir            *g_cache_dir;
-	gchar           *monitor_prefix;
-	const gchar     *file;
+	GStatBuf st;
 
-	g_cache_dir = g_dir_open (cache_dir, 0, NULL);
-	monitor_prefix = g_strdup_printf ("%i_", num_monitor);
+	stat->exists = g_stat (filename, &st) == 0;
+	stat->is_image = FALSE;
+	stat->mtime = stat->exists ? (gint64) st.st_mtime : -1;
+	stat->size = stat->exists ? (gint64) st.st_size : -1;
+}
 
-	file = g_dir_read_name (g_cache_dir);
-	while (file != NULL) {
-		gchar *path = g_build_filename (cache_dir, file, NULL);
+/* Render copies have no monitor, but only live for one draw */
+static const FileStat *
+get_file_stat (MateBG *bg)
+{
+	if (bg->file_stat.generation == bg->file_generation &&
+	    (bg->file_monitor != NULL || bg->render_copy))
+		return &bg->file_stat;
 
-		/* purge files with same monitor id */
-		if (g_str_has_prefix (file, monitor_prefix) &&
-		    g_file_test (path, G_FILE_TEST_IS_REGULAR))
-			g_unlink (path);
+	bg->file_stat.generation = bg->file_generation;
 
-		g_free (path);
+	if (bg->filename) {
+		file_stat_query (bg->filename, &bg->file_stat);
+		bg->file_stat.is_image = bg->file_stat.exists &&
+			gdk_pixbuf_get_file_info (bg->filename, NULL, NULL) != NULL;
+	} else {
+		bg->file_stat.exists = FALSE;
+		bg->file_stat.is_image = FALSE;
+		bg->file_stat.mtime = -1;
+		bg->file_stat.size = -1;
+	}
+
+	return &bg->file_stat;
+}
+
+static inline gchar *
+get_wallpaper_cache_dir (void)
+{
+	return g_build_filename (g_get_user_cache_dir(), MATE_BG_CACHE_DIR, NULL);
+}
+
+/*
+ * On-disk cache of scaled wallpapers
+ *
+ * Entries are named after a hash of the source file identity (path,
+ * modification time and size) and of the size and placement they were
+ * scaled for, so a changed source simply stops matching. The "index" file
+ * in the cache directory lists the entries with their size and last use;
+ * it is shared by all the processes using MateBG and bounds the cache to
+ * a byte budget, dropping the least recently used entries first. Files it
+ * does not list are removed, once per process or when it is missing.
+ * Updates of the index and of the files it lists are serialized between
+ * processes by a lock on the "lock" file.
+ */
+#define DISK_CACHE_INDEX "index"
+#define DISK_CACHE_LOCK "lock"
+#define DISK_CACHE_TMP_SUFFIX ".tmp"
+#define DISK_CACHE_FRAME_SUFFIX ".frame"
+/* Frames are made from the scaled images also in the cache, and are
+ * large: they are not counted in the budget, which is for scaled images,
+ * but only the most recently used few are kept. */
+#define DISK_CACHE_MAX_FRAMES 2
+/* temporary files older than this were left behind by a crash */
+#define DISK_CACHE_TMP_MAX_AGE (60 * 60)
+#define DISK_CACHE_INDEX_HEADER "MATE-BG-CACHE 1"
+#define DISK_CACHE_BUDGET_DEFAULT (256 * 1024 * 1024)
+
+/* Raw entries are the pixbuf data behind a small header, so that a hit
+ * is a single read with no decoding */
+#define DISK_CACHE_RAW_MAGIC 0x4342474d /* "MGBC" */
+#define DISK_CACHE_RAW_VERSION 1
+
+typedef enum {
+	DISK_CACHE_FORMAT_RAW,
+	DISK_CACHE_FORMAT_PNG
+} DiskCacheFormat;
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint32 width;
+	guint32 height;
+	guint32 rowstride;
+	guint32 has_alpha;
+} DiskCacheRawHeader;
+
+typedef struct {
+	char   *name;      /* file name in the cache directory */
+	guint64 size;
+	gint64  last_used; /* in seconds */
+	gboolean dirty;    /* changed since the index was last written */
+	gboolean frame;    /* a frame entry, see DISK_CACHE_MAX_FRAMES */
+	GList   link;
+} DiskCacheEntry;
+
+typedef struct {
+	gboolean        loaded;
+	GHashTable     *entries; /* name -> DiskCacheEntry */
+	GQueue          lru;     /* most recently used first */
+	guint64         bytes;   /* of the entries that are not frames */
+	guint           n_frames;
+	guint64         budget;
+	DiskCacheFormat format;
+	gboolean        swept;   /* the directory was checked against the index */
+} DiskCache;
+
+G_LOCK_DEFINE_STATIC (disk_cache);
+static DiskCache disk_cache = {
+	FALSE, NULL, G_QUEUE_INIT, 0, 0,
+	DISK_CACHE_BUDGET_DEFAULT, DISK_CACHE_FORMAT_RAW, FALSE
+};
+
+static void
+disk_cache_entry_free (DiskCacheEntry *entry)
+{
+	g_free (entry->name);
+	g_free (entry);
+}
+
+static const char *
+disk_cache_format_suffix (DiskCacheFormat format)
+{
+	return (format == DISK_CACHE_FORMAT_PNG) ? "png" : "raw";
+}
+
+/* Called with the lock held */
+static void
+disk_cache_add_locked (const char *name,
+		       guint64     size,
+		       gint64      last_used)
+{
+	DiskCacheEntry *entry;
+
+	entry = g_hash_table_lookup (disk_cache.entries, name);
+	if (entry) {
+		g_queue_unlink (&disk_cache.lru, &entry->link);
+		if (!entry->frame)
+			disk_cache.bytes -= entry->size;
+	} else {
+		entry = g_new0 (DiskCacheEntry, 1);
+		entry->name = g_strdup (name);
+		entry->frame = g_str_has_suffix (name, DISK_CACHE_FRAME_SUFFIX);
+		entry->link.data = entry;
+		g_hash_table_insert (disk_cache.entries, entry->name, entry);
+
+		if (entry->frame)
+			disk_cache.n_frames++;
+	}
+
+	entry->size = size;
+	entry->last_used = last_used;
+	entry->dirty = TRUE;
+	if (!entry->frame)
+		disk_cache.bytes += size;
 
-		file = g_dir_read_name (g_cache_dir);
+	/* keep the queue sorted by last use */
+	if (disk_cache.lru.head == NULL ||
+	    ((DiskCacheEntry *) disk_cache.lru.head->data)->last_used <= last_used) {
+		g_queue_push_head_link (&disk_cache.lru, &entry->link);
+	} else {
+		GList *l = disk_cache.lru.head;
+
+		while (l->next && ((DiskCacheEntry *) l->next->data)->last_used > last_used)
+			l = l->next;
+
+		/* insert after l */
+		entry->link.prev = l;
+		entry->link.next = l->next;
+		if (l->next)
+			l->next->prev = &entry->link;
+		else
+			disk_cache.lru.tail = &entry->link;
+		l->next = &entry->link;
+		disk_cache.lru.length++;
 	}
+}
+
+/* Called with the lock held */
+static void
+disk_cache_remove_locked (DiskCacheEntry *entry)
+{
+	g_queue_unlink (&disk_cache.lru, &entry->link);
+	if (entry->frame)
+		disk_cache.n_frames--;
+	else
+		disk_cache.bytes -= entry->size;
+	g_hash_table_remove (disk_cache.entries, entry->name);
+}
 
-	g_free (monitor_prefix);
-	g_dir_close (g_cache_dir);
+static GHashTable *
+disk_cache_entries_new (void)
+{
+	return g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+				      (GDestroyNotify) disk_cache_entry_free);
 }
 
+/* Replaces the in-memory view with the entries listed in the index file,
+ * keeping only the changes made here since the index was last written.
+ * Called with the lock held. Returns FALSE if there is no index. */
 static gboolean
-cache_file_is_valid (const char *filename,
-		     const char *cache_filename)
+disk_cache_read_index_locked (const char *cache_dir)
 {
-	if (!g_file_test (cache_filename, G_FILE_TEST_IS_REGULAR))
+	GHashTable *old_entries;
+	GQueue old_lru;
+	gchar *index_path;
+	gchar *contents;
+	gchar **lines;
+	GList *l;
+	guint i;
+
+	index_path = g_build_filename (cache_dir, DISK_CACHE_INDEX, NULL);
+	if (!g_file_get_contents (index_path, &contents, NULL, NULL)) {
+		g_free (index_path);
+		return FALSE;
+	}
+	g_free (index_path);
+
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	if (lines[0] == NULL || strcmp (lines[0], DISK_CACHE_INDEX_HEADER) != 0) {
+		g_strfreev (lines);
 		return FALSE;
+	}
+
+	old_entries = disk_cache.entries;
+	old_lru = disk_cache.lru;
+
+	disk_cache.entries = disk_cache_entries_new ();
+	g_queue_init (&disk_cache.lru);
+	disk_cache.bytes = 0;
+	disk_cache.n_frames = 0;
+
+	for (i = 1; lines[i] != NULL; i++) {
+		gchar **fields = g_strsplit (lines[i], " ", 3);
+
+		if (g_strv_length (fields) == 3 &&
+		    strchr (fields[0], G_DIR_SEPARATOR) == NULL) {
+			DiskCacheEntry *entry;
+			guint64 size = g_ascii_strtoull (fields[1], NULL, 10);
+			gint64 last_used = g_ascii_strtoll (fields[2], NULL, 10);
+
+			disk_cache_add_locked (fields[0], size, last_used);
+			entry = g_hash_table_lookup (disk_cache.entries, fields[0]);
+			entry->dirty = FALSE;
+		}
+
+		g_strfreev (fields);
+	}
+
+	g_strfreev (lines);
+
+	/* oldest first, so that the LRU order is kept */
+	for (l = old_lru.tail; l != NULL; l = l->prev) {
+		DiskCacheEntry *old = l->data;
+		DiskCacheEntry *entry;
+
+		if (!old->dirty)
+			continue;
+
+		entry = g_hash_table_lookup (disk_cache.entries, old->name);
+		if (entry == NULL || entry->last_used <= old->last_used)
+			disk_cache_add_locked (old->name, old->size, old->last_used);
+	}
+
+	g_hash_table_destroy (old_entries);
 
-	return (get_mtime (filename) < get_mtime (cache_filename));
+	return TRUE;
 }
 
+/* Called with the lock held */
 static void
-refresh_cache_file (MateBG     *bg,
-		    GdkPixbuf  *new_pixbuf,
-		    gint        num_monitor,
-		    gint        width,
-		    gint        height)
+disk_cache_ensure_loaded_locked (const char *cache_dir)
 {
-	gchar           *cache_filename;
-	gchar           *cache_dir;
-	GdkPixbufFormat *format;
-	gchar           *format_name;
-
-	if ((num_monitor == -1) || (width <= 300) || (height <= 300))
+	if (disk_cache.loaded)
 		return;
 
-	cache_filename = get_wallpaper_cache_filename (bg->filename, num_monitor,
-							bg->placement, width, height);
-	cache_dir = get_wallpaper_cache_dir ();
+	disk_cache.entries = disk_cache_entries_new ();
+	disk_cache.loaded = TRUE;
 
-	/* Only refresh scaled file on disk if useful (and don't cache slideshow) */
-	if (!cache_file_is_valid (bg->filename, cache_filename)) {
-		format = gdk_pixbuf_get_file_info (bg->filename, NULL, NULL);
+	disk_cache_read_index_locked (cache_dir);
+}
 
-		if (format != NULL) {
-			if (!g_file_test (cache_dir, G_FILE_TEST_IS_DIR)) {
-				g_mkdir_with_parents (cache_dir, 0700);
-			} else {
-				cleanup_cache_for_monitor (cache_dir, num_monitor);
-			}
+/* Takes the lock other processes updating the cache directory also take;
+ * returns the descriptor to pass to disk_cache_unlock_dir(), or -1 if
+ * there is no such lock here, in which case the cache is used unlocked. */
+static int
+disk_cache_lock_dir (const char *cache_dir)
+{
+	gchar *lock_path;
+	int fd;
 
-			format_name = gdk_pixbuf_format_get_name (format);
+	lock_path = g_build_filename (cache_dir, DISK_CACHE_LOCK, NULL);
+	fd = g_open (lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	g_free (lock_path);
 
-			if (strcmp (format_name, "jpeg") == 0)
-				gdk_pixbuf_save (new_pixbuf, cache_filename, format_name,
-						 NULL, "quality", "100", NULL);
-			else
-				gdk_pixbuf_save (new_pixbuf, cache_filename, format_name,
-						 NULL, NULL);
+	if (fd < 0)
+		return -1;
 
-			g_free (format_name);
+	while (flock (fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			close (fd);
+			return -1;
 		}
 	}
 
-	g_free (cache_filename);
-	g_free (cache_dir);
+	return fd;
 }
 
 static void
-file_changed (GFileMonitor     *file_monitor,
-	      GFile            *child,
-	      GFile            *other_file,
-	      GFileMonitorEvent event_type,
-	      gpointer          user_data)
+disk_cache_unlock_dir (int fd)
 {
-	MateBG *bg = MATE_BG (user_data);
-
-	clear_cache (bg);
-	queue_changed (bg);
+	if (fd >= 0)
+		close (fd);
 }
 
-void
-mate_bg_set_filename (MateBG	 *bg,
-		      const char *filename)
+/* Forgets the entries whose file is gone, and returns the paths of the
+ * files that are not entries: leftovers of crashes and of other versions
+ * of MateBG. Called with the lock held. */
+static GSList *
+disk_cache_check_files_locked (const char *cache_dir)
 {
-	g_return_if_fail (bg != NULL);
+	GHashTable *present;
+	GSList *stray = NULL;
+	const gchar *file;
+	gint64 now;
+	GList *l, *next;
+	GDir *dir;
+
+	dir = g_dir_open (cache_dir, 0, NULL);
+	if (dir == NULL)
+		return NULL;
 
-	if (is_different (bg, filename)) {
-		g_free (bg->filename);
+	present = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	now = g_get_real_time () / G_USEC_PER_SEC;
 
-		bg->filename = g_strdup (filename);
-		bg->file_mtime = get_mtime (bg->filename);
+	while ((file = g_dir_read_name (dir)) != NULL) {
+		GStatBuf st;
+		gchar *path;
 
-		if (bg->file_monitor) {
-			g_object_unref (bg->file_monitor);
-			bg->file_monitor = NULL;
-		}
+		if (strcmp (file, DISK_CACHE_INDEX) == 0 ||
+		    strcmp (file, DISK_CACHE_LOCK) == 0)
+			continue;
 
-		if (bg->filename) {
-			GFile *f = g_file_new_for_path (bg->filename);
+		path = g_build_filename (cache_dir, file, NULL);
 
-			bg->file_monitor = g_file_monitor_file (f, 0, NULL, NULL);
-			g_signal_connect (bg->file_monitor, "changed",
-					  G_CALLBACK (file_changed), bg);
+		if (g_lstat (path, &st) != 0 || !S_ISREG (st.st_mode)) {
+			g_free (path);
+			continue;
+		}
 
-			g_object_unref (f);
+		if (g_hash_table_contains (disk_cache.entries, file)) {
+			g_hash_table_add (present, g_strdup (file));
+			g_free (path);
+		} else if (g_str_has_suffix (file, DISK_CACHE_TMP_SUFFIX) &&
+			   now - st.st_mtime < DISK_CACHE_TMP_MAX_AGE) {
+			/* still being written */
+			g_free (path);
+		} else {
+			stray = g_slist_prepend (stray, path);
 		}
+	}
 
-		clear_cache (bg);
+	g_dir_close (dir);
 
-		queue_changed (bg);
+	for (l = disk_cache.lru.head; l != NULL; l = next) {
+		DiskCacheEntry *entry = l->data;
+
+		next = l->next;
+		if (!g_hash_table_contains (present, entry->name))
+			disk_cache_remove_locked (entry);
 	}
+
+	g_hash_table_destroy (present);
+
+	return stray;
 }
 
-static void
-draw_color_area (MateBG       *bg,
-		 GdkPixbuf    *dest,
-		 GdkRectangle *rect)
+/* Writes the index, after picking up what other processes changed since
+ * we last looked, and evicts entries over the budget. Called with the
+ * lock held, and the one of the cache directory; returns the paths of
+ * the files to unlink before the latter is released. */
+static GSList *
+disk_cache_sync_locked (const char *cache_dir)
 {
-	guint32 pixel;
-	GdkRectangle extent;
+	GString *index;
+	GSList *evicted = NULL;
+	gchar *index_path;
+	GList *l, *prev;
+
+	/* Listing the directory is only needed when there is no valid index
+	 * to trust, and once per process to catch what others left behind */
+	if (!disk_cache_read_index_locked (cache_dir) || !disk_cache.swept) {
+		evicted = disk_cache_check_files_locked (cache_dir);
+		disk_cache.swept = TRUE;
+	}
 
-        extent.x = 0;
-        extent.y = 0;
-        extent.width = gdk_pixbuf_get_width (dest);
-        extent.height = gdk_pixbuf_get_height (dest);
+	/* the most recently used entry stays, even if it alone is over budget */
+	for (l = disk_cache.lru.tail; l != NULL && l != disk_cache.lru.head; l = prev) {
+		DiskCacheEntry *entry = l->data;
 
-	gdk_rectangle_intersect (rect, &extent, rect);
+		prev = l->prev;
 
-	switch (bg->color_type) {
-	case MATE_BG_COLOR_SOLID:
-		/* not really a big deal to ignore the area of interest */
-		pixel = ((guint) (bg->primary.red * 0xff) << 24)   |
-			((guint) (bg->primary.green * 0xff) << 16) |
-			((guint) (bg->primary.blue * 0xff) << 8)   |
-			(0xff);
+		if (entry->frame ? disk_cache.n_frames <= DISK_CACHE_MAX_FRAMES :
+				   disk_cache.bytes <= disk_cache.budget)
+			continue;
 
-		gdk_pixbuf_fill (dest, pixel);
-		break;
+		evicted = g_slist_prepend (evicted,
+					   g_build_filename (cache_dir, entry->name, NULL));
+		disk_cache_remove_locked (entry);
+	}
 
-	case MATE_BG_COLOR_H_GRADIENT:
-		pixbuf_draw_gradient (dest, TRUE, &(bg->primary), &(bg->secondary), rect);
-		break;
+	index = g_string_new (DISK_CACHE_INDEX_HEADER "\n");
+	for (l = disk_cache.lru.head; l != NULL; l = l->next) {
+		DiskCacheEntry *entry = l->data;
 
-	case MATE_BG_COLOR_V_GRADIENT:
-		pixbuf_draw_gradient (dest, FALSE, &(bg->primary), &(bg->secondary), rect);
-		break;
+		g_string_append_printf (index, "%s %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+					entry->name, entry->size, entry->last_used);
+	}
 
-	default:
-		break;
+	index_path = g_build_filename (cache_dir, DISK_CACHE_INDEX, NULL);
+	if (g_file_set_contents (index_path, index->str, index->len, NULL)) {
+		for (l = disk_cache.lru.head; l != NULL; l = l->next)
+			((DiskCacheEntry *) l->data)->dirty = FALSE;
 	}
+	g_free (index_path);
+	g_string_free (index, TRUE);
+
+	return evicted;
 }
 
 static void
-draw_color (MateBG    *bg,
-	    GdkPixbuf *dest)
+disk_cache_unlink_evicted (GSList *evicted)
 {
-	GdkRectangle rect;
+	GSList *l;
 
-	rect.x = 0;
-	rect.y = 0;
-	rect.width = gdk_pixbuf_get_width (dest);
-	rect.height = gdk_pixbuf_get_height (dest);
-	draw_color_area (bg, dest, &rect);
+	for (l = evicted; l != NULL; l = l->next)
+		g_unlink (l->data);
+
+	g_slist_free_full (evicted, g_free);
 }
 
+/* Sets the budget (-1 for none) and storage format of the disk cache */
 static void
-draw_color_each_monitor (MateBG    *bg,
-			 GdkPixbuf *dest,
-			 GdkScreen *screen)
+disk_cache_configure (gint64          budget,
+		      DiskCacheFormat format)
 {
-	GdkDisplay *display;
-	GdkRectangle rect;
-	gint num_monitors;
-	int monitor;
-
-	display = gdk_screen_get_display (screen);
-	num_monitors = gdk_display_get_n_monitors (display);
-	for (monitor = 0; monitor < num_monitors; monitor++) {
-		gdk_monitor_get_geometry (gdk_display_get_monitor (display, monitor), &rect);
-		draw_color_area (bg, dest, &rect);
-	}
+	G_LOCK (disk_cache);
+	disk_cache.budget = (budget < 0) ? G_MAXUINT64 : (guint64) budget;
+	disk_cache.format = format;
+	G_UNLOCK (disk_cache);
 }
 
-static GdkPixbuf *
-pixbuf_clip_to_fit (GdkPixbuf *src,
-		    int        max_width,
-		    int        max_height)
+static void
+load_disk_cache_settings (GSettings *settings)
 {
-	int src_width, src_height;
-	int w, h;
-	int src_x, src_y;
-	GdkPixbuf *pixbuf;
+	GSettingsSchema *schema;
+	gint64 budget = DISK_CACHE_BUDGET_DEFAULT;
+	DiskCacheFormat format = DISK_CACHE_FORMAT_RAW;
 
-	src_width = gdk_pixbuf_get_width (src);
-	src_height = gdk_pixbuf_get_height (src);
+	g_object_get (settings, "settings-schema", &schema, NULL);
 
-	if (src_width < max_width && src_height < max_height)
-		return g_object_ref (src);
+	if (g_settings_schema_has_key (schema, MATE_BG_KEY_CACHE_MAXIMUM_SIZE)) {
+		gint size = g_settings_get_int (settings, MATE_BG_KEY_CACHE_MAXIMUM_SIZE);
 
-	w = MIN(src_width, max_width);
-	h = MIN(src_height, max_height);
+		budget = (size < 0) ? -1 : (gint64) size * 1024 * 1024;
+	}
 
-	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-				 gdk_pixbuf_get_has_alpha (src),
-				 8, w, h);
+	if (g_settings_schema_has_key (schema, MATE_BG_KEY_CACHE_FORMAT))
+		format = g_settings_get_enum (settings, MATE_BG_KEY_CACHE_FORMAT);
 
-	src_x = (src_width - w) / 2;
-	src_y = (src_height - h) / 2;
-	gdk_pixbuf_copy_area (src,
-			      src_x, src_y,
-			      w, h,
-			      pixbuf,
-			      0, 0);
-	return pixbuf;
+	g_settings_schema_unref (schema);
+
+	disk_cache_configure (budget, format);
 }
 
-static GdkPixbuf *
-get_scaled_pixbuf (MateBGPlacement  placement,
-		   GdkPixbuf       *pixbuf,
-		   int width, int height,
+/* Name of the cache entry for @filename, as described by @stat, or NULL
+ * if it cannot be cached */
+static char *
+disk_cache_entry_name (const char     *filename,
+		       const FileStat *stat,
+		       MateBGPlacement placement,
+		       gint            width,
+		       gint            height)
+{
+	gchar *identity;
+	gchar *hash;
+
+	if (!stat->exists)
+		return NULL;
+
+	identity = g_strdup_printf ("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n%d\n%d\n%d",
+				    filename, stat->mtime, stat->size,
+				    width, height, (gint) placement);
+	hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, identity, -1);
+	g_free (identity);
+
+	return hash;
+}
+
+static gboolean
+disk_cache_write_raw (GdkPixbuf   *pixbuf,
+		      const char  *path)
+{
+	DiskCacheRawHeader header;
+	gsize length;
+	gboolean ret;
+	int fd;
+
+	header.magic = DISK_CACHE_RAW_MAGIC;
+	header.version = DISK_CACHE_RAW_VERSION;
+	header.width = gdk_pixbuf_get_width (pixbuf);
+	header.height = gdk_pixbuf_get_height (pixbuf);
+	header.rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	header.has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+
+	fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return FALSE;
+
+	length = gdk_pixbuf_get_byte_length (pixbuf);
+	ret = write (fd, &header, sizeof (header)) == sizeof (header) &&
+	      write (fd, gdk_pixbuf_read_pixels (pixbuf), length) == (gssize) length;
+
+	return g_close (fd, NULL) && ret;
+}
+
+static GdkPixbuf *
+disk_cache_read_raw (const char *path)
+{
+	DiskCacheRawHeader header;
+	GdkPixbuf *pixbuf;
+	GBytes *bytes, *data;
+	gchar *contents;
+	gsize length;
+	gsize needed;
+
+	if (!g_file_get_contents (path, &contents, &length, NULL))
+		return NULL;
+
+	bytes = g_bytes_new_take (contents, length);
+	if (length < sizeof (header)) {
+		g_bytes_unref (bytes);
+		return NULL;
+	}
+
+	memcpy (&header, contents, sizeof (header));
+
+	needed = (gsize) header.rowstride * (header.height - 1) +
+		 (gsize) header.width * (header.has_alpha ? 4 : 3);
+	if (header.magic != DISK_CACHE_RAW_MAGIC ||
+	    header.version != DISK_CACHE_RAW_VERSION ||
+	    header.width == 0 || header.height == 0 ||
+	    header.rowstride < header.width * (header.has_alpha ? 4 : 3) ||
+	    length - sizeof (header) < needed) {
+		g_bytes_unref (bytes);
+		return NULL;
+	}
+
+	data = g_bytes_new_from_bytes (bytes, sizeof (header), length - sizeof (header));
+	pixbuf = gdk_pixbuf_new_from_bytes (data, GDK_COLORSPACE_RGB,
+					    header.has_alpha, 8,
+					    header.width, header.height,
+					    header.rowstride);
+	g_bytes_unref (data);
+	g_bytes_unref (bytes);
+
+	return pixbuf;
+}
+
+/* Frame entries hold a whole composed background, as the rows of a cairo
+ * image surface behind a header, and are mapped straight into a surface
+ * on a hit. They are always stored this way, whatever the format
+ * setting says. */
+#define DISK_CACHE_FRAME_MAGIC 0x4642474d /* "MGBF" */
+#define DISK_CACHE_FRAME_VERSION 1
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint32 width;
+	guint32 height;
+	guint32 stride;
+	guint32 format; /* cairo_format_t */
+	guint8  padding[40]; /* keeps the rows 64-byte aligned in the mapping */
+} DiskCacheFrameHeader;
+
+G_STATIC_ASSERT (sizeof (DiskCacheFrameHeader) == 64);
+
+static const cairo_user_data_key_t frame_mapping_key;
+
+static gboolean
+disk_cache_write_frame (cairo_surface_t *frame,
+			const char      *path)
+{
+	DiskCacheFrameHeader header;
+	gsize length;
+	gboolean ret;
+	int fd;
+
+	memset (&header, 0, sizeof (header));
+	header.magic = DISK_CACHE_FRAME_MAGIC;
+	header.version = DISK_CACHE_FRAME_VERSION;
+	header.width = cairo_image_surface_get_width (frame);
+	header.height = cairo_image_surface_get_height (frame);
+	header.stride = cairo_image_surface_get_stride (frame);
+	header.format = cairo_image_surface_get_format (frame);
+
+	fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return FALSE;
+
+	length = (gsize) header.stride * header.height;
+	ret = write (fd, &header, sizeof (header)) == sizeof (header) &&
+	      write (fd, cairo_image_surface_get_data (frame), length) == (gssize) length;
+
+	return g_close (fd, NULL) && ret;
+}
+
+/* Returns an image surface using the mapped file as its data */
+static cairo_surface_t *
+disk_cache_map_frame (const char *path)
+{
+	DiskCacheFrameHeader header;
+	cairo_surface_t *surface;
+	GMappedFile *mapping;
+	guchar *contents;
+	gsize length;
+	int fd;
+
+	fd = g_open (path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	/* a private, writable mapping: drawing on the surface is allowed, and
+	 * only touches copies of the pages, never the file */
+	mapping = g_mapped_file_new_from_fd (fd, TRUE, NULL);
+	close (fd);
+	if (mapping == NULL)
+		return NULL;
+
+	contents = (guchar *) g_mapped_file_get_contents (mapping);
+	length = g_mapped_file_get_length (mapping);
+	if (length < sizeof (header)) {
+		g_mapped_file_unref (mapping);
+		return NULL;
+	}
+
+	memcpy (&header, contents, sizeof (header));
+
+	if (header.magic != DISK_CACHE_FRAME_MAGIC ||
+	    header.version != DISK_CACHE_FRAME_VERSION ||
+	    (header.format != CAIRO_FORMAT_RGB24 && header.format != CAIRO_FORMAT_ARGB32) ||
+	    header.width == 0 || header.height == 0 || header.width > G_MAXINT ||
+	    header.stride != (guint32) cairo_format_stride_for_width (header.format, header.width) ||
+	    length - sizeof (header) < (gsize) header.stride * header.height) {
+		g_mapped_file_unref (mapping);
+		return NULL;
+	}
+
+	surface = cairo_image_surface_create_for_data (contents + sizeof (header),
+						       header.format,
+						       header.width, header.height,
+						       header.stride);
+	if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy (surface);
+		g_mapped_file_unref (mapping);
+		return NULL;
+	}
+
+	/* the mapping lives as long as the surface */
+	cairo_surface_set_user_data (surface, &frame_mapping_key, mapping,
+				     (cairo_destroy_func_t) g_mapped_file_unref);
+
+	return surface;
+}
+
+/* Name of the frame entry for @bg drawn on the given geometry, or NULL if
+ * it should not be cached: only still images are, slideshows change, and
+ * only for the root window or areas the size of the whole screen, not for
+ * every window with a background. */
+static char *
+disk_cache_frame_name (MateBG       *bg,
+		       int           width,
+		       int           height,
+		       const GArray *monitors,
+		       gboolean      root)
+{
+	const FileStat *stat;
+	GString *identity;
+	gchar *hash;
+	gchar *name;
+	guint i;
+
+	if (!bg->filename || width <= 300 || height <= 300)
+		return NULL;
+
+	if (!root) {
+		GdkRectangle extent;
+
+		if (monitors->len == 0)
+			return NULL;
+
+		extent = g_array_index (monitors, GdkRectangle, 0);
+		for (i = 1; i < monitors->len; i++)
+			gdk_rectangle_union (&extent,
+					     &g_array_index (monitors, GdkRectangle, i),
+					     &extent);
+
+		if (width != extent.width || height != extent.height)
+			return NULL;
+	}
+
+	stat = get_file_stat (bg);
+	if (!stat->is_image)
+		return NULL;
+
+	identity = g_string_new (NULL);
+	g_string_append_printf (identity, "%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n",
+				bg->filename, stat->mtime, stat->size);
+	g_string_append_printf (identity, "%d %d %d %d %d\n",
+				width, height, root,
+				(gint) bg->placement, (gint) bg->color_type);
+	g_string_append_printf (identity, "%.6f %.6f %.6f %.6f %.6f %.6f\n",
+				bg->primary.red, bg->primary.green, bg->primary.blue,
+				bg->secondary.red, bg->secondary.green, bg->secondary.blue);
+	for (i = 0; i < monitors->len; i++) {
+		GdkRectangle *rect = &g_array_index (monitors, GdkRectangle, i);
+
+		g_string_append_printf (identity, "%d %d %d %d\n",
+					rect->x, rect->y, rect->width, rect->height);
+	}
+
+	hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, identity->str, identity->len);
+	name = g_strconcat (hash, DISK_CACHE_FRAME_SUFFIX, NULL);
+
+	g_free (hash);
+	g_string_free (identity, TRUE);
+
+	return name;
+}
+
+static cairo_surface_t *
+disk_cache_load_frame (const char *name)
+{
+	cairo_surface_t *surface = NULL;
+	DiskCacheEntry *entry;
+	gchar *cache_dir;
+	gchar *path;
+
+	cache_dir = get_wallpaper_cache_dir ();
+
+	G_LOCK (disk_cache);
+	disk_cache_ensure_loaded_locked (cache_dir);
+	entry = g_hash_table_lookup (disk_cache.entries, name);
+	if (entry)
+		disk_cache_add_locked (name, entry->size,
+				       g_get_real_time () / G_USEC_PER_SEC);
+	G_UNLOCK (disk_cache);
+
+	if (entry) {
+		path = g_build_filename (cache_dir, name, NULL);
+		surface = disk_cache_map_frame (path);
+
+		/* gone or damaged: forget about it */
+		if (surface == NULL) {
+			G_LOCK (disk_cache);
+			entry = g_hash_table_lookup (disk_cache.entries, name);
+			if (entry)
+				disk_cache_remove_locked (entry);
+			G_UNLOCK (disk_cache);
+
+			g_unlink (path);
+		}
+
+		g_free (path);
+	}
+
+	g_free (cache_dir);
+
+	return surface;
+}
+
+/* What to store: either a scaled image, or a whole frame */
+typedef struct {
+	char            *name;
+	GdkPixbuf       *pixbuf;
+	cairo_surface_t *frame;
+} DiskCacheStore;
+
+static void
+disk_cache_store_free (DiskCacheStore *store)
+{
+	g_free (store->name);
+	if (store->pixbuf)
+		g_object_unref (store->pixbuf);
+	if (store->frame)
+		cairo_surface_destroy (store->frame);
+	g_free (store);
+}
+
+static void
+disk_cache_store_thread (GTask        *task,
+			 gpointer      source_object,
+			 gpointer      task_data,
+			 GCancellable *cancellable)
+{
+	DiskCacheStore *store = task_data;
+	DiskCacheFormat format;
+	GSList *evicted;
+	gchar *cache_dir;
+	gchar *path;
+	gchar *tmp_path;
+	gboolean written = FALSE;
+	GStatBuf st;
+	int fd;
+
+	G_LOCK (disk_cache);
+	format = disk_cache.format;
+	G_UNLOCK (disk_cache);
+
+	cache_dir = get_wallpaper_cache_dir ();
+	g_mkdir_with_parents (cache_dir, 0700);
+
+	path = g_build_filename (cache_dir, store->name, NULL);
+
+	/* write to a temporary file, so that readers never see half an entry */
+	tmp_path = g_strconcat (path, ".XXXXXX" DISK_CACHE_TMP_SUFFIX, NULL);
+	fd = g_mkstemp_full (tmp_path, O_WRONLY, 0600);
+	if (fd >= 0) {
+		close (fd);
+
+		if (store->frame)
+			written = disk_cache_write_frame (store->frame, tmp_path);
+		else if (format == DISK_CACHE_FORMAT_PNG)
+			written = gdk_pixbuf_save (store->pixbuf, tmp_path, "png", NULL,
+						   "compression", "1", NULL);
+		else
+			written = disk_cache_write_raw (store->pixbuf, tmp_path);
+	}
+
+	if (written) {
+		/* so that nobody sees the file before it is indexed */
+		G_LOCK (disk_cache);
+		fd = disk_cache_lock_dir (cache_dir);
+		disk_cache_ensure_loaded_locked (cache_dir);
+
+		written = g_rename (tmp_path, path) == 0 && g_stat (path, &st) == 0;
+		if (written)
+			disk_cache_add_locked (store->name, st.st_size,
+					       g_get_real_time () / G_USEC_PER_SEC);
+
+		evicted = disk_cache_sync_locked (cache_dir);
+		disk_cache_unlink_evicted (evicted);
+
+		disk_cache_unlock_dir (fd);
+		G_UNLOCK (disk_cache);
+	}
+
+	if (!written)
+		g_unlink (tmp_path);
+
+	g_free (tmp_path);
+	g_free (path);
+	g_free (cache_dir);
+
+	g_task_return_boolean (task, written);
+}
+
+/* Encoding and writing happen in the background; takes @store */
+static void
+disk_cache_store (DiskCacheStore *store)
+{
+	GTask *task;
+
+	task = g_task_new (NULL, NULL, NULL, NULL);
+	g_task_set_source_tag (task, disk_cache_store);
+	g_task_set_task_data (task, store, (GDestroyNotify) disk_cache_store_free);
+	g_task_run_in_thread (task, disk_cache_store_thread);
+	g_object_unref (task);
+}
+
+static void
+disk_cache_store_frame (char            *name,
+			cairo_surface_t *frame)
+{
+	DiskCacheStore *store;
+
+	store = g_new0 (DiskCacheStore, 1);
+	store->name = name;
+	store->frame = cairo_surface_reference (frame);
+
+	disk_cache_store (store);
+}
+
+static void
+refresh_cache_file (MateBG     *bg,
+		    GdkPixbuf  *new_pixbuf,
+		    gint        num_monitor,
+		    gint        width,
+		    gint        height)
+{
+	const FileStat *stat;
+	DiskCacheFormat format;
+	DiskCacheStore *store;
+	gchar *cache_dir;
+	gchar *name;
+	gchar *base;
+	gboolean cached;
+
+	if ((num_monitor == -1) || (width <= 300) || (height <= 300))
+		return;
+
+	/* Only images: don't cache slideshows */
+	stat = get_file_stat (bg);
+	if (!stat->is_image)
+		return;
+
+	base = disk_cache_entry_name (bg->filename, stat, bg->placement, width, height);
+	if (base == NULL)
+		return;
+
+	cache_dir = get_wallpaper_cache_dir ();
+
+	G_LOCK (disk_cache);
+	disk_cache_ensure_loaded_locked (cache_dir);
+	format = disk_cache.format;
+	name = g_strdup_printf ("%s.%s", base, disk_cache_format_suffix (format));
+	cached = g_hash_table_contains (disk_cache.entries, name);
+	G_UNLOCK (disk_cache);
+
+	g_free (cache_dir);
+	g_free (base);
+
+	if (cached) {
+		g_free (name);
+		return;
+	}
+
+	store = g_new0 (DiskCacheStore, 1);
+	store->name = name;
+	store->pixbuf = g_object_ref (new_pixbuf);
+
+	disk_cache_store (store);
+}
+
+static void
+file_changed (GFileMonitor     *file_monitor,
+	      GFile            *child,
+	      GFile            *other_file,
+	      GFileMonitorEvent event_type,
+	      gpointer          user_data)
+{
+	MateBG *bg = MATE_BG (user_data);
+
+	bg->file_generation++;
+
+	if (bg->filename)
+		shared_pixbuf_forget (bg->filename);
+
+	clear_cache (bg);
+	queue_changed (bg);
+}
+
+void
+mate_bg_set_filename (MateBG	 *bg,
+		      const char *filename)
+{
+	g_return_if_fail (bg != NULL);
+
+	if (is_different (bg, filename)) {
+		g_free (bg->filename);
+
+		bg->filename = g_strdup (filename);
+		bg->file_generation++;
+
+		if (bg->file_monitor) {
+			g_object_unref (bg->file_monitor);
+			bg->file_monitor = NULL;
+		}
+
+		if (bg->filename) {
+			GFile *f = g_file_new_for_path (bg->filename);
+
+			bg->file_monitor = g_file_monitor_file (f, 0, NULL, NULL);
+			if (bg->file_monitor)
+				g_signal_connect (bg->file_monitor, "changed",
+						  G_CALLBACK (file_changed), bg);
+			else
+				bg->file_mtime = get_mtime (bg->filename);
+
+			g_object_unref (f);
+		}
+
+		clear_cache (bg);
+
+		queue_changed (bg);
+	}
+}
+
+static void
+draw_color_area (MateBG       *bg,
+		 GdkPixbuf    *dest,
+		 GdkRectangle *rect)
+{
+	guint32 pixel;
+	GdkRectangle extent;
+
+        extent.x = 0;
+        extent.y = 0;
+        extent.width = gdk_pixbuf_get_width (dest);
+        extent.height = gdk_pixbuf_get_height (dest);
+
+	gdk_rectangle_intersect (rect, &extent, rect);
+
+	switch (bg->color_type) {
+	case MATE_BG_COLOR_SOLID:
+		/* not really a big deal to ignore the area of interest */
+		pixel = ((guint) (bg->primary.red * 0xff) << 24)   |
+			((guint) (bg->primary.green * 0xff) << 16) |
+			((guint) (bg->primary.blue * 0xff) << 8)   |
+			(0xff);
+
+		gdk_pixbuf_fill (dest, pixel);
+		break;
+
+	case MATE_BG_COLOR_H_GRADIENT:
+		pixbuf_draw_gradient (dest, TRUE, &(bg->primary), &(bg->secondary), rect);
+		break;
+
+	case MATE_BG_COLOR_V_GRADIENT:
+		pixbuf_draw_gradient (dest, FALSE, &(bg->primary), &(bg->secondary), rect);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void
+draw_color (MateBG    *bg,
+	    GdkPixbuf *dest)
+{
+	GdkRectangle rect;
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.width = gdk_pixbuf_get_width (dest);
+	rect.height = gdk_pixbuf_get_height (dest);
+	draw_color_area (bg, dest, &rect);
+}
+
+/* Snapshot of the monitor layout of @screen, so that drawing does not
+ * need to call into GDK (and can thus happen off the main thread). */
+static GArray *
+get_monitor_geometries (GdkScreen *screen)
+{
+	GdkDisplay *display;
+	GArray *monitors;
+	gint num_monitors;
+	gint monitor;
+
+	display = gdk_screen_get_display (screen);
+	num_monitors = gdk_display_get_n_monitors (display);
+	monitors = g_array_sized_new (FALSE, FALSE, sizeof (GdkRectangle), num_monitors);
+
+	for (monitor = 0; monitor < num_monitors; monitor++) {
+		GdkRectangle rect;
+
+		gdk_monitor_get_geometry (gdk_display_get_monitor (display, monitor), &rect);
+		g_array_append_val (monitors, rect);
+	}
+
+	return monitors;
+}
+
+static void
+draw_color_each_monitor (MateBG       *bg,
+			 GdkPixbuf    *dest,
+			 const GArray *monitors)
+{
+	guint monitor;
+
+	for (monitor = 0; monitor < monitors->len; monitor++)
+		draw_color_area (bg, dest, &g_array_index (monitors, GdkRectangle, monitor));
+}
+
+static GdkPixbuf *
+pixbuf_clip_to_fit (GdkPixbuf *src,
+		    int        max_width,
+		    int        max_height)
+{
+	int src_width, src_height;
+	int w, h;
+	int src_x, src_y;
+	GdkPixbuf *pixbuf;
+
+	src_width = gdk_pixbuf_get_width (src);
+	src_height = gdk_pixbuf_get_height (src);
+
+	if (src_width < max_width && src_height < max_height)
+		return g_object_ref (src);
+
+	w = MIN(src_width, max_width);
+	h = MIN(src_height, max_height);
+
+	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+				 gdk_pixbuf_get_has_alpha (src),
+				 8, w, h);
+
+	src_x = (src_width - w) / 2;
+	src_y = (src_height - h) / 2;
+	gdk_pixbuf_copy_area (src,
+			      src_x, src_y,
+			      w, h,
+			      pixbuf,
+			      0, 0);
+	return pixbuf;
+}
+
+static GdkPixbuf *
+get_scaled_pixbuf (MateBGPlacement  placement,
+		   GdkPixbuf       *pixbuf,
+		   int width, int height,
 		   int *x, int *y,
 		   int *w, int *h)
 {
@@ -926,111 +1973,701 @@ get_scaled_pixbuf (MateBGPlacement  placement,
 	*x = (width - *w) / 2;
 	*y = (height - *h) / 2;
 
-	return new;
+	return new;
+}
+
+/* If @scaled_p points to the result of get_scaled_pixbuf() for @area, it
+ * is used as is; if it points to NULL, it is set to the new result */
+static void
+draw_image_area (MateBG        *bg,
+		 GdkPixbuf     *pixbuf,
+		 GdkPixbuf     *dest,
+		 GdkRectangle  *area,
+		 GdkPixbuf    **scaled_p)
+{
+	int dest_width = area->width;
+	int dest_height = area->height;
+	int x, y, w, h;
+	GdkPixbuf *scaled;
+
+	if (!pixbuf)
+		return;
+
+	if (scaled_p && *scaled_p) {
+		scaled = g_object_ref (*scaled_p);
+		w = gdk_pixbuf_get_width (scaled);
+		h = gdk_pixbuf_get_height (scaled);
+		x = (dest_width - w) / 2;
+		y = (dest_height - h) / 2;
+	} else {
+		scaled = get_scaled_pixbuf (bg->placement, pixbuf, dest_width, dest_height, &x, &y, &w, &h);
+	}
+
+	switch (bg->placement) {
+	case MATE_BG_PLACEMENT_TILED:
+		pixbuf_tile (scaled, dest);
+		break;
+	case MATE_BG_PLACEMENT_ZOOMED:
+	case MATE_BG_PLACEMENT_CENTERED:
+	case MATE_BG_PLACEMENT_FILL_SCREEN:
+	case MATE_BG_PLACEMENT_SCALED:
+		pixbuf_blend (scaled, dest, 0, 0, w, h, x + area->x, y + area->y, 1.0);
+		break;
+	case MATE_BG_PLACEMENT_SPANNED:
+		pixbuf_blend (scaled, dest, 0, 0, w, h, x, y, 1.0);
+		break;
+	default:
+		g_assert_not_reached ();
+		break;
+	}
+
+	if (scaled_p && !*scaled_p)
+		*scaled_p = scaled;
+	else
+		g_object_unref (scaled);
+}
+
+/* Where get_scaled_pixbuf() would put the image in an area of @width x
+ * @height: the rectangle the whole source is scaled to, relative to the
+ * area, which may extend past it when the image gets cropped */
+static void
+get_placement_geometry (MateBGPlacement  placement,
+			int              src_width,
+			int              src_height,
+			int              width,
+			int              height,
+			GdkRectangle    *geometry)
+{
+	double factor;
+	int w, h;
+
+	switch (placement) {
+	case MATE_BG_PLACEMENT_SPANNED:
+	case MATE_BG_PLACEMENT_SCALED:
+		factor = MIN (width / (double) src_width, height / (double) src_height);
+		geometry->width = floor (src_width * factor + 0.5);
+		geometry->height = floor (src_height * factor + 0.5);
+		geometry->x = (width - geometry->width) / 2;
+		geometry->y = (height - geometry->height) / 2;
+		break;
+
+	case MATE_BG_PLACEMENT_ZOOMED:
+		factor = MAX (width / (double) src_width, height / (double) src_height);
+		geometry->width = floor (src_width * factor + 0.5);
+		geometry->height = floor (src_height * factor + 0.5);
+		geometry->x = (geometry->width - width) / -2;
+		geometry->y = (geometry->height - height) / -2;
+		break;
+
+	case MATE_BG_PLACEMENT_FILL_SCREEN:
+		geometry->x = 0;
+		geometry->y = 0;
+		geometry->width = width;
+		geometry->height = height;
+		break;
+
+	case MATE_BG_PLACEMENT_CENTERED:
+	case MATE_BG_PLACEMENT_TILED:
+	default:
+		w = MIN (src_width, width);
+		h = MIN (src_height, height);
+		geometry->x = (width - w) / 2 - (src_width - w) / 2;
+		geometry->y = (height - h) / 2 - (src_height - h) / 2;
+		geometry->width = src_width;
+		geometry->height = src_height;
+		break;
+	}
+}
+
+/* The image of @bg as it is placed on an area of @width x @height: the
+ * tile for tiled backgrounds, else the scaled image, cropped to the area */
+static cairo_surface_t *
+create_placed_surface (MateBG    *bg,
+		       GdkPixbuf *pixbuf,
+		       int        width,
+		       int        height)
+{
+	cairo_surface_t *source;
+	cairo_surface_t *placed;
+	cairo_pattern_t *pattern;
+	cairo_matrix_t matrix;
+	GdkRectangle geometry;
+	GdkRectangle visible = { 0, 0, width, height };
+	cairo_t *cr;
+	int src_width, src_height;
+
+	if (bg->placement == MATE_BG_PLACEMENT_TILED) {
+		GdkPixbuf *tile;
+
+		tile = pixbuf_clip_to_fit (pixbuf, width, height);
+		placed = surface_from_pixbuf (tile);
+		g_object_unref (tile);
+
+		return placed;
+	}
+
+	src_width = gdk_pixbuf_get_width (pixbuf);
+	src_height = gdk_pixbuf_get_height (pixbuf);
+
+	get_placement_geometry (bg->placement, src_width, src_height,
+				width, height, &geometry);
+	if (!gdk_rectangle_intersect (&geometry, &visible, &visible))
+		return NULL;
+
+	source = surface_from_pixbuf (pixbuf);
+	pattern = cairo_pattern_create_for_surface (source);
+
+	/* pattern space is the source, user space the visible part */
+	cairo_matrix_init_scale (&matrix,
+				 src_width / (double) geometry.width,
+				 src_height / (double) geometry.height);
+	cairo_matrix_translate (&matrix, visible.x - geometry.x, visible.y - geometry.y);
+	cairo_pattern_set_matrix (pattern, &matrix);
+
+	if (geometry.width == src_width && geometry.height == src_height) {
+		cairo_pattern_set_filter (pattern, CAIRO_FILTER_NEAREST);
+	} else {
+		/* padding keeps the edges from fading out */
+		cairo_pattern_set_filter (pattern, CAIRO_FILTER_GOOD);
+		cairo_pattern_set_extend (pattern, CAIRO_EXTEND_PAD);
+	}
+
+	placed = cairo_image_surface_create (gdk_pixbuf_get_has_alpha (pixbuf) ?
+					     CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+					     visible.width, visible.height);
+
+	cr = cairo_create (placed);
+	cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source (cr, pattern);
+	cairo_paint (cr);
+	cairo_destroy (cr);
+
+	cairo_pattern_destroy (pattern);
+	cairo_surface_destroy (source);
+
+	return placed;
+}
+
+/* Same as draw_image_area(), but straight onto the image surface @target
+ * with cairo, without scaled pixbufs in between. @target must be flushed
+ * by the caller. Each call only touches @area (but for tiles), through a
+ * surface of its own, so that monitors can be painted in parallel.
+ * @placed_p works as @scaled_p does for draw_image_area(). */
+static void
+paint_image_area (MateBG             *bg,
+		  GdkPixbuf          *pixbuf,
+		  cairo_surface_t    *target,
+		  const GdkRectangle *area,
+		  cairo_surface_t   **placed_p)
+{
+	cairo_surface_t *placed;
+	cairo_surface_t *dest;
+	cairo_t *cr;
+
+	if (!pixbuf || area->width <= 0 || area->height <= 0)
+		return;
+
+	if (placed_p && *placed_p)
+		placed = cairo_surface_reference (*placed_p);
+	else
+		placed = create_placed_surface (bg, pixbuf, area->width, area->height);
+
+	if (!placed)
+		return;
+
+	if (bg->placement == MATE_BG_PLACEMENT_TILED) {
+		/* tiles start at the origin of the whole destination */
+		dest = cairo_surface_reference (target);
+		cr = cairo_create (dest);
+		cairo_set_source_surface (cr, placed, 0, 0);
+		cairo_pattern_set_extend (cairo_get_source (cr), CAIRO_EXTEND_REPEAT);
+	} else {
+		GdkRectangle extent = { 0, 0, 0, 0 };
+		GdkRectangle visible;
+		unsigned char *data;
+		int stride;
+
+		/* the image is placed for the whole area, but only the part
+		 * within @target is painted */
+		extent.width = cairo_image_surface_get_width (target);
+		extent.height = cairo_image_surface_get_height (target);
+		if (!gdk_rectangle_intersect (area, &extent, &visible)) {
+			cairo_surface_destroy (placed);
+			return;
+		}
+
+		data = cairo_image_surface_get_data (target);
+		stride = cairo_image_surface_get_stride (target);
+		dest = cairo_image_surface_create_for_data (data + (gsize) visible.y * stride + (gsize) visible.x * 4,
+							    cairo_image_surface_get_format (target),
+							    visible.width, visible.height, stride);
+
+		/* centered, as draw_image_area() does */
+		cr = cairo_create (dest);
+		cairo_set_source_surface (cr, placed,
+					  area->x - visible.x +
+					  (area->width - cairo_image_surface_get_width (placed)) / 2,
+					  area->y - visible.y +
+					  (area->height - cairo_image_surface_get_height (placed)) / 2);
+	}
+
+	cairo_paint (cr);
+	cairo_destroy (cr);
+
+	cairo_surface_finish (dest);
+	cairo_surface_destroy (dest);
+
+	if (placed_p && !*placed_p)
+		*placed_p = placed;
+	else
+		cairo_surface_destroy (placed);
+}
+
+/* Draws @pixbuf on @area of the pixbuf @dest, or, when @surface is not
+ * NULL, paints it on the image surface @surface instead; @scaled_p and
+ * @placed_p are passed on to each */
+static void
+render_image_area (MateBG           *bg,
+		   GdkPixbuf        *pixbuf,
+		   GdkPixbuf        *dest,
+		   cairo_surface_t  *surface,
+		   GdkRectangle     *area,
+		   GdkPixbuf       **scaled_p,
+		   cairo_surface_t **placed_p)
+{
+	if (surface)
+		paint_image_area (bg, pixbuf, surface, area, placed_p);
+	else
+		draw_image_area (bg, pixbuf, dest, area, scaled_p);
+}
+
+static void
+draw_image_for_thumb (MateBG     *bg,
+		      GdkPixbuf  *pixbuf,
+		      GdkPixbuf  *dest)
+{
+	GdkRectangle rect;
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.width = gdk_pixbuf_get_width (dest);
+	rect.height = gdk_pixbuf_get_height (dest);
+
+	draw_image_area (bg, pixbuf, dest, &rect, NULL);
+}
+
+/* Scaling and compositing the image of each monitor is independent work,
+ * which is spread over a thread pool shared by all the MateBG of the
+ * process. Loading the images and looking up their scaled versions goes
+ * through the caches and stays on the calling thread. */
+typedef struct {
+	MateBG          *bg;
+	GdkPixbuf       *pixbuf;
+	GdkPixbuf       *dest;
+	cairo_surface_t *surface;
+	GdkRectangle     rect;
+	gint             monitor;
+
+	/* the file @pixbuf comes from, NULL if its scaled versions should
+	 * not be cached (slideshow transitions) */
+	char            *source;
+	/* the scaled image from the cache, or as made by the job */
+	GdkPixbuf       *scaled;
+	cairo_surface_t *placed;
+	gboolean         scaled_cached;
+} MonitorJob;
+
+/* Takes the image just returned by get_pixbuf_for_size(), and looks
+ * up its scaled version for @rect */
+static void
+monitor_job_init (MonitorJob      *job,
+		  MateBG          *bg,
+		  GdkPixbuf       *pixbuf,
+		  GdkPixbuf       *dest,
+		  cairo_surface_t *surface,
+		  GdkRectangle    *rect,
+		  gint             monitor)
+{
+	job->bg = bg;
+	job->pixbuf = pixbuf;
+	job->dest = dest;
+	job->surface = surface;
+	job->rect = *rect;
+	job->monitor = monitor;
+	job->source = g_strdup (bg->pixbuf_cache_source);
+
+	if (job->source && rect->width > 0 && rect->height > 0) {
+		if (surface)
+			job->placed = file_cache_lookup_scaled (bg, job->source,
+								rect->width, rect->height,
+								TRUE);
+		else
+			job->scaled = file_cache_lookup_scaled (bg, job->source,
+								rect->width, rect->height,
+								FALSE);
+		job->scaled_cached = job->scaled || job->placed;
+	}
+}
+
+static void
+monitor_job_run (MonitorJob *job)
+{
+	render_image_area (job->bg, job->pixbuf,
+			   job->dest, job->surface, &job->rect,
+			   &job->scaled, &job->placed);
+}
+
+/* Caches what the job scaled, back on the calling thread */
+static void
+monitor_job_clear (MonitorJob *job)
+{
+	if (job->scaled && !job->scaled_cached)
+		refresh_cache_file (job->bg, job->scaled, job->monitor,
+				    job->rect.width, job->rect.height);
+
+	if (job->source && !job->scaled_cached) {
+		if (job->placed)
+			file_cache_add_scaled (job->bg, job->source,
+					       job->rect.width, job->rect.height,
+					       job->placed, TRUE);
+		else if (job->scaled)
+			file_cache_add_scaled (job->bg, job->source,
+					       job->rect.width, job->rect.height,
+					       job->scaled, FALSE);
+	}
+
+	g_clear_object (&job->scaled);
+	g_clear_pointer (&job->placed, cairo_surface_destroy);
+	g_clear_object (&job->pixbuf);
+	g_free (job->source);
+	job->source = NULL;
+}
+
+static void
+draw_once (MateBG          *bg,
+	   GdkPixbuf       *dest,
+	   cairo_surface_t *surface,
+	   gboolean         is_root)
+{
+	GdkRectangle rect;
+	GdkPixbuf   *pixbuf;
+	gint         monitor;
+
+	/* whether we're drawing on root window or normal (Caja) window */
+	monitor = (is_root) ? 0 : -1;
+
+	rect.x = 0;
+	rect.y = 0;
+	if (surface) {
+		rect.width = cairo_image_surface_get_width (surface);
+		rect.height = cairo_image_surface_get_height (surface);
+	} else {
+		rect.width = gdk_pixbuf_get_width (dest);
+		rect.height = gdk_pixbuf_get_height (dest);
+	}
+
+	pixbuf = get_pixbuf_for_size (bg, monitor, rect.width, rect.height);
+	if (pixbuf) {
+		MonitorJob job = { NULL, };
+
+		monitor_job_init (&job, bg, pixbuf, dest, surface, &rect, monitor);
+		monitor_job_run (&job);
+		monitor_job_clear (&job);
+	}
+}
+
+typedef struct {
+	MonitorJob *jobs;
+	gint        n_jobs;
+	gint        next_job;
+	gint        n_workers;
+	GMutex      lock;
+	GCond       done;
+} MonitorBatch;
+
+G_LOCK_DEFINE_STATIC (render_pool);
+static GThreadPool *render_pool = NULL;
+
+static void
+monitor_batch_run (MonitorBatch *batch)
+{
+	gint i;
+
+	while ((i = g_atomic_int_add (&batch->next_job, 1)) < batch->n_jobs) {
+		MonitorJob *job = &batch->jobs[i];
+
+		monitor_job_run (job);
+	}
+}
+
+static void
+render_pool_worker (gpointer data,
+		    gpointer user_data)
+{
+	MonitorBatch *batch = data;
+
+	monitor_batch_run (batch);
+
+	g_mutex_lock (&batch->lock);
+	if (--batch->n_workers == 0)
+		g_cond_signal (&batch->done);
+	g_mutex_unlock (&batch->lock);
+}
+
+static guint
+get_render_threads (MateBG *bg)
+{
+	if (bg->max_render_threads > 0)
+		return bg->max_render_threads;
+
+	return g_get_num_processors ();
+}
+
+/* The monitors have to be drawn one after the other if their areas
+ * overlap (cloned outputs), or if each covers the whole destination
+ * (tiling) */
+static gboolean
+monitor_jobs_are_independent (MateBG     *bg,
+			      MonitorJob *jobs,
+			      guint       n_jobs)
+{
+	guint i, j;
+
+	if (bg->placement == MATE_BG_PLACEMENT_TILED)
+		return FALSE;
+
+	for (i = 0; i < n_jobs; i++) {
+		for (j = i + 1; j < n_jobs; j++) {
+			if (gdk_rectangle_intersect (&jobs[i].rect, &jobs[j].rect, NULL))
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+run_monitor_jobs (MateBG     *bg,
+		  MonitorJob *jobs,
+		  guint       n_jobs)
+{
+	MonitorBatch batch;
+	guint n_threads;
+	guint i;
+
+	n_threads = MIN (get_render_threads (bg), n_jobs);
+
+	if (n_threads <= 1 || !monitor_jobs_are_independent (bg, jobs, n_jobs)) {
+		for (i = 0; i < n_jobs; i++)
+			monitor_job_run (&jobs[i]);
+		return;
+	}
+
+	G_LOCK (render_pool);
+	if (render_pool == NULL)
+		render_pool = g_thread_pool_new (render_pool_worker, NULL,
+						 g_get_num_processors (),
+						 FALSE, NULL);
+	G_UNLOCK (render_pool);
+
+	batch.jobs = jobs;
+	batch.n_jobs = n_jobs;
+	batch.next_job = 0;
+	batch.n_workers = n_threads - 1;
+	g_mutex_init (&batch.lock);
+	g_cond_init (&batch.done);
+
+	/* The workers and this thread take jobs until there are none
+	 * left; then wait for the workers to be done with theirs */
+	for (i = 0; i < n_threads - 1; i++)
+		g_thread_pool_push (render_pool, &batch, NULL);
+
+	monitor_batch_run (&batch);
+
+	g_mutex_lock (&batch.lock);
+	while (batch.n_workers > 0)
+		g_cond_wait (&batch.done, &batch.lock);
+	g_mutex_unlock (&batch.lock);
+
+	g_mutex_clear (&batch.lock);
+	g_cond_clear (&batch.done);
 }
 
-static void
-draw_image_area (MateBG        *bg,
-		 gint           num_monitor,
-		 GdkPixbuf     *pixbuf,
-		 GdkPixbuf     *dest,
-		 GdkRectangle  *area)
+/* Monitors of the same size show the same thing: only the first one of
+ * each size (its leader) is drawn, the others get a copy of the leader's
+ * area. A leader has to lie within @extent, the area being drawn, for
+ * its copy to be complete. Returns, for each monitor, the index of its
+ * leader, or -1 if it has to be drawn itself. */
+static gint *
+make_render_plan (MateBG             *bg,
+		  const GArray       *monitors,
+		  const GdkRectangle *extent)
 {
-	int dest_width = area->width;
-	int dest_height = area->height;
-	int x, y, w, h;
-	GdkPixbuf *scaled;
+	gint *leaders;
+	guint i, j;
 
-	if (!pixbuf)
-		return;
+	leaders = g_new (gint, monitors->len);
+	for (i = 0; i < monitors->len; i++)
+		leaders[i] = -1;
 
-	scaled = get_scaled_pixbuf (bg->placement, pixbuf, dest_width, dest_height, &x, &y, &w, &h);
+	/* Copies are only correct if areas don't partly overlap, and
+	 * tiles cover the whole destination anyway */
+	if (bg->placement == MATE_BG_PLACEMENT_TILED)
+		return leaders;
 
-	switch (bg->placement) {
-	case MATE_BG_PLACEMENT_TILED:
-		pixbuf_tile (scaled, dest);
-		break;
-	case MATE_BG_PLACEMENT_ZOOMED:
-	case MATE_BG_PLACEMENT_CENTERED:
-	case MATE_BG_PLACEMENT_FILL_SCREEN:
-	case MATE_BG_PLACEMENT_SCALED:
-		pixbuf_blend (scaled, dest, 0, 0, w, h, x + area->x, y + area->y, 1.0);
-		break;
-	case MATE_BG_PLACEMENT_SPANNED:
-		pixbuf_blend (scaled, dest, 0, 0, w, h, x, y, 1.0);
-		break;
-	default:
-		g_assert_not_reached ();
-		break;
+	for (i = 0; i < monitors->len; i++) {
+		GdkRectangle *a = &g_array_index (monitors, GdkRectangle, i);
+
+		for (j = i + 1; j < monitors->len; j++) {
+			GdkRectangle *b = &g_array_index (monitors, GdkRectangle, j);
+
+			if (!gdk_rectangle_equal (a, b) &&
+			    gdk_rectangle_intersect (a, b, NULL))
+				return leaders;
+		}
 	}
 
-	refresh_cache_file (bg, scaled, num_monitor, dest_width, dest_height);
+	for (i = 0; i < monitors->len; i++) {
+		GdkRectangle *a = &g_array_index (monitors, GdkRectangle, i);
 
-	g_object_unref (scaled);
+		for (j = 0; j < i; j++) {
+			GdkRectangle *b = &g_array_index (monitors, GdkRectangle, j);
+			GdkRectangle visible;
+
+			if (leaders[j] == -1 &&
+			    a->width == b->width && a->height == b->height &&
+			    gdk_rectangle_intersect (b, extent, &visible) &&
+			    gdk_rectangle_equal (b, &visible)) {
+				leaders[i] = j;
+				break;
+			}
+		}
+	}
+
+	return leaders;
 }
 
+/* Copies the @from area of the image surface @surface to @dest_x, @dest_y,
+ * which must not overlap it */
 static void
-draw_image_for_thumb (MateBG     *bg,
-		      GdkPixbuf  *pixbuf,
-		      GdkPixbuf  *dest)
+surface_copy_area (cairo_surface_t    *surface,
+		   const GdkRectangle *from,
+		   int                 dest_x,
+		   int                 dest_y)
 {
-	GdkRectangle rect;
+	unsigned char *data;
+	int stride;
+	int y;
 
-	rect.x = 0;
-	rect.y = 0;
-	rect.width = gdk_pixbuf_get_width (dest);
-	rect.height = gdk_pixbuf_get_height (dest);
+	data = cairo_image_surface_get_data (surface);
+	stride = cairo_image_surface_get_stride (surface);
 
-	draw_image_area (bg, -1, pixbuf, dest, &rect);
+	for (y = 0; y < from->height; y++)
+		memcpy (data + (gsize) (dest_y + y) * stride + (gsize) dest_x * 4,
+			data + (gsize) (from->y + y) * stride + (gsize) from->x * 4,
+			(gsize) from->width * 4);
 }
 
 static void
-draw_once (MateBG    *bg,
-	   GdkPixbuf *dest,
-	   gboolean   is_root)
+draw_each_monitor (MateBG          *bg,
+		   GdkPixbuf       *dest,
+		   cairo_surface_t *surface,
+		   const GArray    *monitors)
 {
-	GdkRectangle rect;
-	GdkPixbuf   *pixbuf;
-	gint         monitor;
+	GdkRectangle extent = { 0, 0, 0, 0 };
+	MonitorJob *jobs;
+	gint *leaders;
+	guint n_jobs = 0;
+	guint monitor;
+	guint i;
+
+	if (surface) {
+		extent.width = cairo_image_surface_get_width (surface);
+		extent.height = cairo_image_surface_get_height (surface);
+	} else {
+		extent.width = gdk_pixbuf_get_width (dest);
+		extent.height = gdk_pixbuf_get_height (dest);
+	}
 
-	/* whether we're drawing on root window or normal (Caja) window */
-	monitor = (is_root) ? 0 : -1;
+	jobs = g_new0 (MonitorJob, monitors->len);
+	leaders = make_render_plan (bg, monitors, &extent);
 
-	rect.x = 0;
-	rect.y = 0;
-	rect.width = gdk_pixbuf_get_width (dest);
-	rect.height = gdk_pixbuf_get_height (dest);
+	for (monitor = 0; monitor < monitors->len; monitor++) {
+		GdkRectangle *rect;
+		GdkPixbuf *pixbuf;
 
-	pixbuf = get_pixbuf_for_size (bg, monitor, rect.width, rect.height);
-	if (pixbuf) {
-		draw_image_area (bg, monitor, pixbuf, dest, &rect);
+		if (leaders[monitor] != -1)
+			continue;
 
-		g_object_unref (pixbuf);
+		rect = &g_array_index (monitors, GdkRectangle, monitor);
+
+		/* entirely outside of the destination */
+		if (!gdk_rectangle_intersect (rect, &extent, NULL))
+			continue;
+
+		pixbuf = get_pixbuf_for_size (bg, monitor, rect->width, rect->height);
+		if (pixbuf)
+			monitor_job_init (&jobs[n_jobs++], bg, pixbuf, dest, surface,
+					  rect, monitor);
 	}
-}
 
-static void
-draw_each_monitor (MateBG    *bg,
-		   GdkPixbuf *dest,
-		   GdkScreen *screen)
-{
-	GdkDisplay *display;
+	run_monitor_jobs (bg, jobs, n_jobs);
 
-	display = gdk_screen_get_display (screen);
-	gint num_monitors = gdk_display_get_n_monitors (display);
-	gint monitor = 0;
+	for (monitor = 0; monitor < monitors->len; monitor++) {
+		GdkRectangle *rect, *leader_rect;
+		GdkRectangle visible, from;
 
-	for (; monitor < num_monitors; monitor++) {
-		GdkRectangle rect;
-		GdkPixbuf *pixbuf;
+		if (leaders[monitor] == -1)
+			continue;
 
-		gdk_monitor_get_geometry (gdk_display_get_monitor (display, monitor), &rect);
+		rect = &g_array_index (monitors, GdkRectangle, monitor);
+		leader_rect = &g_array_index (monitors, GdkRectangle, leaders[monitor]);
 
-		pixbuf = get_pixbuf_for_size (bg, monitor, rect.width, rect.height);
-		if (pixbuf) {
-			draw_image_area (bg, monitor, pixbuf, dest, &rect);
+		/* cloned outputs are already drawn */
+		if (gdk_rectangle_equal (rect, leader_rect))
+			continue;
 
-			g_object_unref (pixbuf);
+		/* only the part of the monitor within the destination; the
+		 * leader is entirely within it */
+		if (!gdk_rectangle_intersect (rect, &extent, &visible))
+			continue;
+
+		from.x = leader_rect->x + (visible.x - rect->x);
+		from.y = leader_rect->y + (visible.y - rect->y);
+		from.width = visible.width;
+		from.height = visible.height;
+
+		if (surface)
+			surface_copy_area (surface, &from, visible.x, visible.y);
+		else
+			gdk_pixbuf_copy_area (dest,
+					      from.x, from.y,
+					      from.width, from.height,
+					      dest,
+					      visible.x, visible.y);
+	}
+
+	for (i = 0; i < n_jobs; i++)
+		monitor_job_clear (&jobs[i]);
+	g_free (jobs);
+	g_free (leaders);
+}
+
+static void
+draw_with_monitors (MateBG       *bg,
+		    GdkPixbuf    *dest,
+		    const GArray *monitors,
+		    gboolean      is_root)
+{
+	if (is_root && (bg->placement != MATE_BG_PLACEMENT_SPANNED)) {
+		draw_color_each_monitor (bg, dest, monitors);
+		if (bg->filename) {
+			draw_each_monitor (bg, dest, NULL, monitors);
+		}
+	} else {
+		draw_color (bg, dest);
+		if (bg->filename) {
+			draw_once (bg, dest, NULL, is_root);
 		}
 	}
 }
@@ -1041,20 +2678,14 @@ mate_bg_draw (MateBG     *bg,
 	       GdkScreen *screen,
 	       gboolean   is_root)
 {
+	GArray *monitors;
+
 	if (!bg)
 		return;
 
-	if (is_root && (bg->placement != MATE_BG_PLACEMENT_SPANNED)) {
-		draw_color_each_monitor (bg, dest, screen);
-		if (bg->filename) {
-			draw_each_monitor (bg, dest, screen);
-		}
-	} else {
-		draw_color (bg, dest);
-		if (bg->filename) {
-			draw_once (bg, dest, is_root);
-		}
-	}
+	monitors = get_monitor_geometries (screen);
+	draw_with_monitors (bg, dest, monitors, is_root);
+	g_array_unref (monitors);
 }
 
 gboolean
@@ -1109,6 +2740,228 @@ mate_bg_get_pixmap_size (MateBG   *bg,
 	}
 }
 
+static void
+paint_color_area (MateBG             *bg,
+		  cairo_t            *cr,
+		  const GdkRectangle *rect)
+{
+	cairo_pattern_t *pattern;
+
+	if (bg->color_type == MATE_BG_COLOR_H_GRADIENT)
+		pattern = cairo_pattern_create_linear (rect->x, 0,
+						       rect->x + rect->width, 0);
+	else if (bg->color_type == MATE_BG_COLOR_V_GRADIENT)
+		pattern = cairo_pattern_create_linear (0, rect->y,
+						       0, rect->y + rect->height);
+	else
+		pattern = cairo_pattern_create_rgb (bg->primary.red,
+						    bg->primary.green,
+						    bg->primary.blue);
+
+	if (bg->color_type != MATE_BG_COLOR_SOLID) {
+		cairo_pattern_add_color_stop_rgb (pattern, 0.0,
+						  bg->primary.red,
+						  bg->primary.green,
+						  bg->primary.blue);
+		cairo_pattern_add_color_stop_rgb (pattern, 1.0,
+						  bg->secondary.red,
+						  bg->secondary.green,
+						  bg->secondary.blue);
+	}
+
+	cairo_set_source (cr, pattern);
+	cairo_rectangle (cr, rect->x, rect->y, rect->width, rect->height);
+	cairo_fill (cr);
+	cairo_pattern_destroy (pattern);
+}
+
+/* Same as draw_color_area() on each monitor, or on the whole area, but
+ * straight to @cr with cairo patterns: no intermediate pixbuf */
+static void
+paint_color (MateBG       *bg,
+	     cairo_t      *cr,
+	     int           width,
+	     int           height,
+	     const GArray *monitors,
+	     gboolean      is_root)
+{
+	if (bg->color_type == MATE_BG_COLOR_SOLID) {
+		gdk_cairo_set_source_rgba (cr, &(bg->primary));
+		cairo_paint (cr);
+	} else if (is_root && (bg->placement != MATE_BG_PLACEMENT_SPANNED)) {
+		guint monitor;
+
+		for (monitor = 0; monitor < monitors->len; monitor++)
+			paint_color_area (bg, cr, &g_array_index (monitors, GdkRectangle, monitor));
+	} else {
+		GdkRectangle rect = { 0, 0, width, height };
+
+		paint_color_area (bg, cr, &rect);
+	}
+}
+
+/* Same as draw_with_monitors(), on an image surface: the colors and the
+ * images are painted with cairo straight into @surface, which can then be
+ * used as is for the window */
+static void
+paint_with_monitors (MateBG          *bg,
+		     cairo_surface_t *surface,
+		     const GArray    *monitors,
+		     gboolean         is_root)
+{
+	int width, height;
+	cairo_t *cr;
+
+	width = cairo_image_surface_get_width (surface);
+	height = cairo_image_surface_get_height (surface);
+
+	cr = cairo_create (surface);
+	paint_color (bg, cr, width, height, monitors, is_root);
+	cairo_destroy (cr);
+
+	if (!bg->filename)
+		return;
+
+	cairo_surface_flush (surface);
+
+	if (is_root && (bg->placement != MATE_BG_PLACEMENT_SPANNED)) {
+		draw_each_monitor (bg, NULL, surface, monitors);
+	} else {
+		draw_once (bg, NULL, surface, is_root);
+	}
+
+	cairo_surface_mark_dirty (surface);
+}
+
+/* Converts @pixbuf to a cairo image surface, premultiplying the colors
+ * if it has alpha; unlike gdk_cairo_set_source_pixbuf(), this does not
+ * involve GDK and can run in a worker thread. */
+static cairo_surface_t *
+surface_from_pixbuf (GdkPixbuf *pixbuf)
+{
+	cairo_surface_t *surface;
+	gboolean has_alpha;
+	int width, height;
+	int n_channels;
+	int src_stride, dest_stride;
+	const guchar *src;
+	guchar *dest;
+	int x, y;
+
+	width = gdk_pixbuf_get_width (pixbuf);
+	height = gdk_pixbuf_get_height (pixbuf);
+	has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+	n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+	src_stride = gdk_pixbuf_get_rowstride (pixbuf);
+	src = gdk_pixbuf_read_pixels (pixbuf);
+
+	surface = cairo_image_surface_create (has_alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+					      width, height);
+	cairo_surface_flush (surface);
+	dest = cairo_image_surface_get_data (surface);
+	dest_stride = cairo_image_surface_get_stride (surface);
+
+	for (y = 0; y < height; y++) {
+		const guchar *s = src + (gsize) y * src_stride;
+		guint32 *d = (guint32 *) (dest + (gsize) y * dest_stride);
+
+		if (has_alpha) {
+			for (x = 0; x < width; x++, s += n_channels) {
+				guint a = s[3];
+
+				d[x] = (a << 24) |
+				       (((s[0] * a + 127) / 255) << 16) |
+				       (((s[1] * a + 127) / 255) << 8) |
+				       ((s[2] * a + 127) / 255);
+			}
+		} else {
+			for (x = 0; x < width; x++, s += n_channels)
+				d[x] = 0xff000000 | (s[0] << 16) | (s[1] << 8) | s[2];
+		}
+	}
+
+	cairo_surface_mark_dirty (surface);
+
+	return surface;
+}
+
+/* Renders the image of @bg into a cairo image surface, by mapping the
+ * frame cached on disk when there is one. Also used on render copies,
+ * in worker threads. */
+static cairo_surface_t *
+render_image_surface (MateBG       *bg,
+		      int           width,
+		      int           height,
+		      const GArray *monitors,
+		      gboolean      root)
+{
+	cairo_surface_t *surface;
+	char *name;
+
+	name = disk_cache_frame_name (bg, width, height, monitors, root);
+	if (name) {
+		surface = disk_cache_load_frame (name);
+		if (surface) {
+			g_free (name);
+			return surface;
+		}
+	}
+
+	surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+	paint_with_monitors (bg, surface, monitors, root);
+
+	if (name)
+		disk_cache_store_frame (name, surface);
+
+	return surface;
+}
+
+/* Creates the surface for @window and paints @image on it, or, when
+ * @image is NULL, the colors of @bg. */
+static cairo_surface_t *
+create_window_surface (MateBG          *bg,
+		       GdkWindow       *window,
+		       int              width,
+		       int              height,
+		       int              scale,
+		       gboolean         root,
+		       const GArray    *monitors,
+		       cairo_surface_t *image)
+{
+	int pm_width, pm_height;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	GdkDisplay *display;
+
+	mate_bg_get_pixmap_size (bg, width, height, &pm_width, &pm_height);
+
+	display = gdk_display_get_default ();
+
+	if ((root) &&  GDK_IS_X11_DISPLAY (display))
+	{
+		surface = make_root_pixmap (window, pm_width * scale, pm_height * scale);
+	}
+	else
+	{
+		surface = gdk_window_create_similar_surface (window, CAIRO_CONTENT_COLOR,
+							     pm_width, pm_height);
+	}
+
+	cr = cairo_create (surface);
+	cairo_scale (cr, (double)scale, (double)scale);
+
+	if (image) {
+		cairo_set_source_surface (cr, image, 0, 0);
+		cairo_paint (cr);
+	} else {
+		paint_color (bg, cr, width, height, monitors, root);
+	}
+
+	cairo_destroy (cr);
+
+	return surface;
+}
+
 /**
  * mate_bg_create_surface:
  * @bg: MateBG
@@ -1159,11 +3012,9 @@ mate_bg_create_surface_scale (MateBG      *bg,
 			      int          scale,
 			      gboolean     root)
 {
-	int pm_width, pm_height;
-
 	cairo_surface_t *surface;
-	cairo_t *cr;
-	GdkDisplay *display;
+	cairo_surface_t *image;
+	GArray *monitors;
 
 	g_return_val_if_fail (bg != NULL, NULL);
 	g_return_val_if_fail (window != NULL, NULL);
@@ -1176,44 +3027,224 @@ mate_bg_create_surface_scale (MateBG      *bg,
 		bg->pixbuf_cache = NULL;
 	}
 
-	mate_bg_get_pixmap_size (bg, width, height, &pm_width, &pm_height);
+	monitors = get_monitor_geometries (gdk_window_get_screen (window));
+
+	/* Colors alone are painted directly with cairo */
+	if (!bg->filename)
+		image = NULL;
+	else
+		image = render_image_surface (bg, width, height, monitors, root);
+
+	surface = create_window_surface (bg, window, width, height, scale, root,
+					 monitors, image);
+
+	if (image)
+		cairo_surface_destroy (image);
+	g_array_unref (monitors);
+
+	return surface;
+}
+
+/* Data of a mate_bg_create_surface_async() request. Everything the worker
+ * thread looks at is a snapshot taken on the main thread: it only renders
+ * @copy, never the MateBG the request was made on. */
+typedef struct {
+	MateBG    *copy;
+	GArray    *monitors;
+	GdkWindow *window;
+	int        width;
+	int        height;
+	int        scale;
+	gboolean   root;
+
+	/* set by the worker if the background is a slideshow */
+	SlideShow *show;
+} CreateSurfaceData;
+
+static void
+create_surface_data_free (CreateSurfaceData *data)
+{
+	if (data->show)
+		slideshow_unref (data->show);
+	g_object_unref (data->copy);
+	g_array_unref (data->monitors);
+	g_object_unref (data->window);
+	g_free (data);
+}
+
+static MateBG *
+mate_bg_copy_for_render (MateBG *bg)
+{
+	MateBG *copy;
+
+	copy = g_object_new (MATE_TYPE_BG, NULL);
+
+	copy->render_copy = TRUE;
+	copy->filename = g_strdup (bg->filename);
+	copy->file_mtime = bg->file_mtime;
+	copy->file_generation = bg->file_generation;
+	copy->file_stat = bg->file_stat;
+	copy->placement = bg->placement;
+	copy->color_type = bg->color_type;
+	copy->primary = bg->primary;
+	copy->secondary = bg->secondary;
+	copy->is_enabled = bg->is_enabled;
+	copy->file_cache_budget = bg->file_cache_budget;
+	copy->max_render_threads = bg->max_render_threads;
+
+	return copy;
+}
+
+static void
+create_surface_thread (GTask        *task,
+		       gpointer      source_object,
+		       gpointer      task_data,
+		       GCancellable *cancellable)
+{
+	CreateSurfaceData *data = task_data;
+	cairo_surface_t *image;
+
+	if (g_task_return_error_if_cancelled (task))
+		return;
+
+	image = render_image_surface (data->copy, data->width, data->height,
+				      data->monitors, data->root);
+
+	/* Drawing already parsed the slideshow, if there is one */
+	if (data->copy->filename)
+		data->show = peek_slideshow (data->copy, data->copy->filename);
+
+	if (g_task_return_error_if_cancelled (task)) {
+		cairo_surface_destroy (image);
+		return;
+	}
+
+	g_task_return_pointer (task, image, (GDestroyNotify) cairo_surface_destroy);
+}
+
+/**
+ * mate_bg_create_surface_async:
+ * @bg: MateBG
+ * @window: the window the surface will be the background of
+ * @width: width of the surface
+ * @height: height of the surface
+ * @scale: window scale factor
+ * @root: whether the surface is for the root window
+ * @cancellable: (nullable): optional #GCancellable object
+ * @callback: a #GAsyncReadyCallback to call when the surface is ready
+ * @user_data: the data to pass to @callback
+ *
+ * Asynchronous version of mate_bg_create_surface_scale(). Loading, scaling
+ * and blending the background images happens in a worker thread, with the
+ * settings @bg has at the time of the call; only the cairo and X work is
+ * done on the main thread, when mate_bg_create_surface_finish() is called.
+ *
+ * Cancelling @cancellable makes the request fail with %G_IO_ERROR_CANCELLED.
+ **/
+void
+mate_bg_create_surface_async (MateBG              *bg,
+			      GdkWindow           *window,
+			      int                  width,
+			      int                  height,
+			      int                  scale,
+			      gboolean             root,
+			      GCancellable        *cancellable,
+			      GAsyncReadyCallback  callback,
+			      gpointer             user_data)
+{
+	CreateSurfaceData *data;
+	GTask *task;
+
+	g_return_if_fail (MATE_IS_BG (bg));
+	g_return_if_fail (GDK_IS_WINDOW (window));
+
+	task = g_task_new (bg, cancellable, callback, user_data);
+	g_task_set_source_tag (task, mate_bg_create_surface_async);
+
+	data = g_new0 (CreateSurfaceData, 1);
+	data->copy = mate_bg_copy_for_render (bg);
+	/* the scaled images of the transitions, not their frames */
+	data->copy->transitions = transitions_copy (bg);
+	data->monitors = get_monitor_geometries (gdk_window_get_screen (window));
+	data->window = g_object_ref (window);
+	data->width = width;
+	data->height = height;
+	data->scale = scale;
+	data->root = root;
+	g_task_set_task_data (task, data, (GDestroyNotify) create_surface_data_free);
+
+	if (!bg->filename) {
+		/* Nothing to render, colors are painted by _finish() */
+		g_task_return_pointer (task, NULL, NULL);
+	} else {
+		g_task_run_in_thread (task, create_surface_thread);
+	}
+
+	g_object_unref (task);
+}
+
+/**
+ * mate_bg_create_surface_finish:
+ * @bg: MateBG
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes a mate_bg_create_surface_async() request.
+ *
+ * Return value: (transfer full): a surface that can be set as background
+ * for the window, or %NULL if the request was cancelled.
+ **/
+cairo_surface_t *
+mate_bg_create_surface_finish (MateBG        *bg,
+			       GAsyncResult  *result,
+			       GError       **error)
+{
+	CreateSurfaceData *data;
+	cairo_surface_t *surface;
+	cairo_surface_t *image;
+
+	g_return_val_if_fail (MATE_IS_BG (bg), NULL);
+	g_return_val_if_fail (g_task_is_valid (result, bg), NULL);
 
-	display = gdk_display_get_default ();
+	data = g_task_get_task_data (G_TASK (result));
+	/* Keep what the worker decoded, or the next request decodes it again */
+	file_cache_adopt_pixbufs (bg, data->copy);
 
-	if ((root) &&  GDK_IS_X11_DISPLAY (display))
-	{
-		surface = make_root_pixmap (window, pm_width * scale, pm_height * scale);
-	}
-	else
-	{
-		surface = gdk_window_create_similar_surface (window, CAIRO_CONTENT_COLOR,
-							     pm_width, pm_height);
-	}
+	image = g_task_propagate_pointer (G_TASK (result), error);
+	if (g_task_had_error (G_TASK (result)))
+		return NULL;
 
-	cr = cairo_create (surface);
-	cairo_scale (cr, (double)scale, (double)scale);
+	/* Arm the slideshow timer, as a synchronous draw would have done,
+	 * unless @bg was pointed somewhere else in the meantime. */
+	if (data->show && g_strcmp0 (bg->filename, data->copy->filename) == 0) {
+		SlideShow *show;
+		double timeout;
 
-	if (!bg->filename && bg->color_type == MATE_BG_COLOR_SOLID) {
-		gdk_cairo_set_source_rgba (cr, &(bg->primary));
-	}
-	else
-	{
-		GdkPixbuf *pixbuf;
+		show = peek_slideshow (bg, bg->filename);
+		if (show)
+			slideshow_unref (show);
+		else
+			file_cache_add_slide_show (bg, bg->filename, data->show);
 
-		pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
-					 width, height);
-		mate_bg_draw (bg, pixbuf, gdk_window_get_screen (window), root);
-		gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
-		g_object_unref (pixbuf);
+		get_current_slide (data->show, NULL, &timeout);
+		ensure_timeout (bg, timeout);
 	}
 
-	cairo_paint (cr);
+	surface = create_window_surface (data->copy, data->window,
+					 data->width, data->height,
+					 data->scale, data->root,
+					 data->monitors, image);
 
-	cairo_destroy (cr);
+	if (image)
+		cairo_surface_destroy (image);
 
 	return surface;
 }
 
+/* A rough average is good enough to pick a text colour: look at no more
+ * than about this many pixels of the background */
+#define IS_DARK_MAX_SAMPLES (512 * 1024)
+
 /* determine if a background is darker or lighter than average, to help
  * clients know what colors to draw on top with
  */
@@ -1240,7 +3271,7 @@ mate_bg_is_dark (MateBG *bg,
 		GdkRGBA argb;
 		guchar a, r, g, b;
 
-		pixbuf_average_value (pixbuf, &argb);
+		pixbuf_average_value (pixbuf, IS_DARK_MAX_SAMPLES, &argb);
 		a = argb.alpha * 0xff;
 		r = argb.red * 0xff;
 		g = argb.green * 0xff;
@@ -1328,7 +3359,7 @@ get_filename_for_size (MateBG *bg, gint best_width, gint best_height)
 		return bg->filename;
 	}
 
-	slide = get_current_slide (show, NULL);
+	slide = get_current_slide (show, NULL, NULL);
 	slideshow_unref (show);
 	size = find_best_size (slide->file1, best_width, best_height);
 	return size->file;
@@ -1684,10 +3715,17 @@ struct _SlideShow
 	double start_time;
 	double total_duration;
 
-	GQueue *slides;
+	GPtrArray *slides;
 
 	gboolean has_multiple_sizes;
 
+	/* the time at which each slide starts relative to start_time,
+	 * plus total_duration at the end */
+	double *offsets;
+
+	/* the compiled file the file names point into, if loaded from one */
+	GMappedFile *mapping;
+
 	/* used during parsing */
 	struct tm start_tm;
 	GQueue *stack;
@@ -1717,31 +3755,45 @@ now (void)
 }
 #endif
 
+/* The slide shown at @time, how far into it we are as @alpha and how
+ * many seconds until the picture changes next as @next_change */
 static Slide *
-get_current_slide (SlideShow *show,
-		   double    *alpha)
+get_slide_state (SlideShow *show,
+		 double     time,
+		 double    *alpha,
+		 double    *next_change)
 {
-	double delta = fmod (now() - show->start_time, show->total_duration);
-	GList *list;
-	double elapsed;
-	int i;
+	double delta = fmod (time - show->start_time, show->total_duration);
+	guint low, high;
 
 	if (delta < 0)
 		delta += show->total_duration;
 
-	elapsed = 0;
-	i = 0;
-	for (list = show->slides->head; list != NULL; list = list->next) {
-		Slide *slide = list->data;
+	/* the current slide is the first one to end after delta */
+	low = 0;
+	high = show->slides->len;
+	while (low < high) {
+		guint middle = low + (high - low) / 2;
 
-		if (elapsed + slide->duration > delta) {
-			if (alpha)
-				*alpha = (delta - elapsed) / (double)slide->duration;
-			return slide;
-		}
+		if (show->offsets[middle + 1] > delta)
+			high = middle;
+		else
+			low = middle + 1;
+	}
 
-		i++;
-		elapsed += slide->duration;
+	if (low < show->slides->len) {
+		Slide *slide = g_ptr_array_index (show->slides, low);
+
+		if (alpha)
+			*alpha = (delta - show->offsets[low]) / (double)slide->duration;
+
+		/* a lone slide never changes, don't wake up at its end */
+		if (next_change && show->slides->len > 1)
+			*next_change = MIN (slide->step, show->offsets[low + 1] - delta);
+		else if (next_change)
+			*next_change = slide->step;
+
+		return slide;
 	}
 
 	/* this should never happen since we have slides and we should always
@@ -1752,12 +3804,20 @@ get_current_slide (SlideShow *show,
 	return NULL;
 }
 
+static Slide *
+get_current_slide (SlideShow *show,
+		   double    *alpha,
+		   double    *next_change)
+{
+	return get_slide_state (show, now (), alpha, next_change);
+}
+
 static GdkPixbuf *
 blend (GdkPixbuf *p1,
        GdkPixbuf *p2,
        double alpha)
 {
-	GdkPixbuf *result = gdk_pixbuf_copy (p1);
+	GdkPixbuf *result;
 	GdkPixbuf *tmp;
 
 	if (gdk_pixbuf_get_width (p2) != gdk_pixbuf_get_width (p1) ||
@@ -1771,124 +3831,667 @@ blend (GdkPixbuf *p1,
 		tmp = g_object_ref (p2);
 	}
 
-	pixbuf_blend (tmp, result, 0, 0, -1, -1, 0, 0, alpha);
+	if (pixbuf_can_lerp (p1, tmp)) {
+		result = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
+					 gdk_pixbuf_get_width (p1),
+					 gdk_pixbuf_get_height (p1));
+		pixbuf_lerp (p1, tmp, result, alpha);
+	} else {
+		result = gdk_pixbuf_copy (p1);
+		pixbuf_blend (tmp, result, 0, 0, -1, -1, 0, 0, alpha);
+	}
 
         g_object_unref (tmp);
 
 	return result;
 }
 
+/* The frames of a transition between two slides are all made from the
+ * same pair of images: keep @to scaled to the size of @from, and render
+ * each step into @frame, which is reused as long as nobody else holds it. */
+#define MAX_TRANSITIONS 4
+
+typedef struct {
+	GdkPixbuf *from;
+	GdkPixbuf *to_source;
+	GdkPixbuf *to;
+	GdkPixbuf *frame;
+} Transition;
+
+static void
+transition_free (Transition *transition)
+{
+	g_object_unref (transition->from);
+	g_object_unref (transition->to_source);
+	g_object_unref (transition->to);
+	if (transition->frame)
+		g_object_unref (transition->frame);
+	g_free (transition);
+}
+
+static GdkPixbuf *
+transition_render (MateBG    *bg,
+		   GdkPixbuf *p1,
+		   GdkPixbuf *p2,
+		   double     alpha)
+{
+	Transition *transition = NULL;
+	int width, height;
+	guint i;
+
+	if (bg->transitions) {
+		for (i = 0; i < bg->transitions->len; i++) {
+			Transition *t = g_ptr_array_index (bg->transitions, i);
+
+			if (t->from == p1 && t->to_source == p2) {
+				transition = t;
+				break;
+			}
+		}
+	}
+
+	width = gdk_pixbuf_get_width (p1);
+	height = gdk_pixbuf_get_height (p1);
+
+	if (!transition) {
+		GdkPixbuf *to;
+
+		if (gdk_pixbuf_get_width (p2) != width ||
+		    gdk_pixbuf_get_height (p2) != height)
+			to = gdk_pixbuf_scale_simple (p2, width, height,
+						      GDK_INTERP_BILINEAR);
+		else
+			to = g_object_ref (p2);
+
+		if (!pixbuf_can_lerp (p1, to)) {
+			g_object_unref (to);
+			return blend (p1, p2, alpha);
+		}
+
+		if (!bg->transitions)
+			bg->transitions = g_ptr_array_new_with_free_func ((GDestroyNotify) transition_free);
+		if (bg->transitions->len == MAX_TRANSITIONS)
+			g_ptr_array_remove_index (bg->transitions, 0);
+
+		transition = g_new0 (Transition, 1);
+		transition->from = g_object_ref (p1);
+		transition->to_source = g_object_ref (p2);
+		transition->to = to;
+		g_ptr_array_add (bg->transitions, transition);
+	}
+
+	/* The previous frame may still be in use, e.g. by a caller of
+	 * get_pixbuf_for_size() */
+	if (transition->frame && G_OBJECT (transition->frame)->ref_count > 1)
+		g_clear_object (&transition->frame);
+
+	if (!transition->frame)
+		transition->frame = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
+						    width, height);
+
+	pixbuf_lerp (transition->from, transition->to, transition->frame, alpha);
+	g_object_set_data (G_OBJECT (transition->frame), "mate-bg-average-value", NULL);
+
+	return g_object_ref (transition->frame);
+}
+
+/* The transitions of @bg without their frames, which @bg keeps using:
+ * the images in them are never modified, and can be shared with a
+ * render copy. */
+static GPtrArray *
+transitions_copy (MateBG *bg)
+{
+	GPtrArray *copy;
+	guint i;
+
+	if (!bg->transitions)
+		return NULL;
+
+	copy = g_ptr_array_new_with_free_func ((GDestroyNotify) transition_free);
+	for (i = 0; i < bg->transitions->len; i++) {
+		Transition *t = g_ptr_array_index (bg->transitions, i);
+		Transition *c = g_new0 (Transition, 1);
+
+		c->from = g_object_ref (t->from);
+		c->to_source = g_object_ref (t->to_source);
+		c->to = g_object_ref (t->to);
+		g_ptr_array_add (copy, c);
+	}
+
+	return copy;
+}
+
+/* Moves the transitions of @from to @bg, unless @bg already has one
+ * between the same images; then only a frame @bg lacks is taken. */
+static void
+transitions_adopt (MateBG *bg,
+		   MateBG *from)
+{
+	guint i, j;
+
+	if (!from->transitions)
+		return;
+
+	for (i = 0; i < from->transitions->len; i++) {
+		Transition *t = g_ptr_array_index (from->transitions, i);
+		Transition *found = NULL;
+
+		if (bg->transitions) {
+			for (j = 0; j < bg->transitions->len && !found; j++) {
+				Transition *u = g_ptr_array_index (bg->transitions, j);
+
+				if (u->from == t->from && u->to_source == t->to_source)
+					found = u;
+			}
+		}
+
+		if (found) {
+			if (!found->frame) {
+				found->frame = t->frame;
+				t->frame = NULL;
+			}
+			continue;
+		}
+
+		if (!bg->transitions)
+			bg->transitions = g_ptr_array_new_with_free_func ((GDestroyNotify) transition_free);
+		if (bg->transitions->len == MAX_TRANSITIONS)
+			g_ptr_array_remove_index (bg->transitions, 0);
+
+		/* ownership moves to @bg */
+		g_ptr_array_index (from->transitions, i) = NULL;
+		g_ptr_array_add (bg->transitions, t);
+	}
+
+	g_ptr_array_set_free_func (from->transitions, NULL);
+	for (i = 0; i < from->transitions->len; i++) {
+		Transition *t = g_ptr_array_index (from->transitions, i);
+
+		if (t)
+			transition_free (t);
+	}
+	g_clear_pointer (&from->transitions, g_ptr_array_unref);
+}
+
 typedef	enum {
 	PIXBUF,
 	SLIDESHOW,
-	THUMBNAIL
+	THUMBNAIL,
+	SCALED,		/* result of get_scaled_pixbuf () */
+	PLACED		/* result of create_placed_surface () */
 } FileType;
 
 struct FileCacheEntry
 {
 	FileType type;
 	char *filename;
-	union {
-		GdkPixbuf *pixbuf;
-		SlideShow *slideshow;
-		GdkPixbuf *thumbnail;
-	} u;
-};
+	/* 0x0 and -1 for entries which do not depend on the requested
+	 * size and placement */
+	gint width;
+	gint height;
+	gint placement;
+	gsize size;
+	GList link;
+	union {
+		GdkPixbuf *pixbuf;
+		SlideShow *slideshow;
+		GdkPixbuf *thumbnail;
+		GdkPixbuf *scaled;
+		cairo_surface_t *placed;
+	} u;
+};
+
+static guint
+file_cache_entry_hash (gconstpointer key)
+{
+	const FileCacheEntry *ent = key;
+	guint hash;
+
+	hash = g_str_hash (ent->filename);
+	hash = (hash * 31) + ent->type;
+	hash = (hash * 31) + ent->width;
+	hash = (hash * 31) + ent->height;
+	hash = (hash * 31) + ent->placement;
+
+	return hash;
+}
+
+static gboolean
+file_cache_entry_equal (gconstpointer a,
+			gconstpointer b)
+{
+	const FileCacheEntry *ent_a = a;
+	const FileCacheEntry *ent_b = b;
+
+	return ent_a->type == ent_b->type &&
+	       ent_a->width == ent_b->width &&
+	       ent_a->height == ent_b->height &&
+	       ent_a->placement == ent_b->placement &&
+	       strcmp (ent_a->filename, ent_b->filename) == 0;
+}
+
+static void
+file_cache_entry_delete (FileCacheEntry *ent)
+{
+	g_free (ent->filename);
+
+	switch (ent->type) {
+	case PIXBUF:
+		g_object_unref (ent->u.pixbuf);
+		break;
+	case SLIDESHOW:
+		slideshow_unref (ent->u.slideshow);
+		break;
+	case THUMBNAIL:
+		g_object_unref (ent->u.thumbnail);
+		break;
+	case SCALED:
+		g_object_unref (ent->u.scaled);
+		break;
+	case PLACED:
+		cairo_surface_destroy (ent->u.placed);
+		break;
+	}
+
+	g_free (ent);
+}
+
+static void
+file_cache_remove (MateBG         *bg,
+		   FileCacheEntry *ent)
+{
+	g_queue_unlink (&bg->file_cache_lru, &ent->link);
+	bg->file_cache_bytes -= ent->size;
+
+	/* frees ent */
+	g_hash_table_remove (bg->file_cache, ent);
+}
+
+static void
+bound_cache (MateBG *bg)
+{
+	while (bg->file_cache_bytes > bg->file_cache_budget &&
+	       bg->file_cache_lru.length > 1) {
+		FileCacheEntry *ent = bg->file_cache_lru.tail->data;
+
+		file_cache_remove (bg, ent);
+		bg->file_cache_evictions++;
+	}
+}
+
+/* Entries made for exactly @width x @height and the current placement are
+ * preferred, otherwise an entry which does not depend on them is returned.
+ * Does not count as a use of the entry. */
+static FileCacheEntry *
+file_cache_find (MateBG     *bg,
+		 FileType    type,
+		 const char *filename,
+		 gint        width,
+		 gint        height)
+{
+	FileCacheEntry key;
+	FileCacheEntry *ent;
+
+	key.type = type;
+	key.filename = (char *) filename;
+	key.width = width;
+	key.height = height;
+	key.placement = (width != 0 || height != 0) ? (gint) bg->placement : -1;
+
+	ent = g_hash_table_lookup (bg->file_cache, &key);
+	if (ent == NULL && (width != 0 || height != 0)) {
+		key.width = 0;
+		key.height = 0;
+		key.placement = -1;
+		ent = g_hash_table_lookup (bg->file_cache, &key);
+	}
+
+	return ent;
+}
+
+static const FileCacheEntry *
+file_cache_lookup (MateBG     *bg,
+		   FileType    type,
+		   const char *filename,
+		   gint        width,
+		   gint        height)
+{
+	FileCacheEntry *ent;
+
+	ent = file_cache_find (bg, type, filename, width, height);
+	if (ent == NULL) {
+		bg->file_cache_misses++;
+		return NULL;
+	}
+
+	bg->file_cache_hits++;
+
+	if (bg->file_cache_lru.head != &ent->link) {
+		g_queue_unlink (&bg->file_cache_lru, &ent->link);
+		g_queue_push_head_link (&bg->file_cache_lru, &ent->link);
+	}
+
+	return ent;
+}
+
+static FileCacheEntry *
+file_cache_entry_new (FileType    type,
+		      const char *filename,
+		      gint        width,
+		      gint        height,
+		      gint        placement)
+{
+	FileCacheEntry *ent = g_new0 (FileCacheEntry, 1);
+
+	ent->type = type;
+	ent->filename = g_strdup (filename);
+	ent->width = width;
+	ent->height = height;
+	ent->placement = placement;
+	ent->link.data = ent;
+
+	return ent;
+}
+
+static void
+file_cache_insert (MateBG         *bg,
+		   FileCacheEntry *ent)
+{
+	g_assert (!g_hash_table_contains (bg->file_cache, ent));
+
+	g_hash_table_add (bg->file_cache, ent);
+	g_queue_push_head_link (&bg->file_cache_lru, &ent->link);
+	bg->file_cache_bytes += ent->size;
+
+	bound_cache (bg);
+}
+
+/* Moves the decoded and scaled images, the slideshows and the transition
+ * buffers cached by @from into the cache of @bg, unless @bg already has them. */
+static void
+file_cache_adopt_pixbufs (MateBG *bg,
+			  MateBG *from)
+{
+	GList *link;
+
+	/* oldest first, so that the LRU order is kept */
+	while ((link = g_queue_peek_tail_link (&from->file_cache_lru)) != NULL) {
+		FileCacheEntry *ent = link->data;
+
+		g_queue_unlink (&from->file_cache_lru, link);
+		from->file_cache_bytes -= ent->size;
+		g_hash_table_steal (from->file_cache, ent);
+
+		if (ent->type == THUMBNAIL ||
+		    g_hash_table_contains (bg->file_cache, ent))
+			file_cache_entry_delete (ent);
+		else
+			file_cache_insert (bg, ent);
+	}
+
+	transitions_adopt (bg, from);
+}
+
+static void
+file_cache_add_pixbuf (MateBG *bg,
+		       const char *filename,
+		       gint width,
+		       gint height,
+		       GdkPixbuf *pixbuf)
+{
+	FileCacheEntry *ent;
+
+	/* sized images depend on the placement they were made for */
+	ent = file_cache_entry_new (PIXBUF, filename, width, height,
+				    (width != 0 || height != 0) ? (gint) bg->placement : -1);
+	ent->u.pixbuf = g_object_ref (pixbuf);
+	ent->size = gdk_pixbuf_get_byte_length (pixbuf);
+	file_cache_insert (bg, ent);
+}
+
+/* The final image of @filename for an area of @width x @height with the
+ * current placement: a #GdkPixbuf made by get_scaled_pixbuf(), or if
+ * @surface is TRUE, a surface made by create_placed_surface() */
+static gpointer
+file_cache_lookup_scaled (MateBG     *bg,
+			  const char *filename,
+			  gint        width,
+			  gint        height,
+			  gboolean    surface)
+{
+	const FileCacheEntry *ent;
+
+	ent = file_cache_lookup (bg, surface ? PLACED : SCALED, filename, width, height);
+	if (ent == NULL)
+		return NULL;
+
+	if (surface)
+		return cairo_surface_reference (ent->u.placed);
+
+	return g_object_ref (ent->u.scaled);
+}
+
+static void
+file_cache_add_scaled (MateBG     *bg,
+		       const char *filename,
+		       gint        width,
+		       gint        height,
+		       gpointer    image,
+		       gboolean    surface)
+{
+	FileCacheEntry *ent;
+	FileType type = surface ? PLACED : SCALED;
+
+	/* several monitors of the same size may have made it */
+	if (file_cache_find (bg, type, filename, width, height))
+		return;
+
+	ent = file_cache_entry_new (type, filename, width, height, (gint) bg->placement);
+	if (surface) {
+		ent->u.placed = cairo_surface_reference (image);
+		ent->size = (gsize) cairo_image_surface_get_stride (image) *
+			    cairo_image_surface_get_height (image);
+	} else {
+		ent->u.scaled = g_object_ref (image);
+		ent->size = gdk_pixbuf_get_byte_length (image);
+	}
+	file_cache_insert (bg, ent);
+}
+
+static void
+file_cache_add_thumbnail (MateBG *bg,
+			  const char *filename,
+			  GdkPixbuf *pixbuf)
+{
+	FileCacheEntry *ent = file_cache_entry_new (THUMBNAIL, filename, 0, 0, -1);
+	ent->u.thumbnail = g_object_ref (pixbuf);
+	ent->size = gdk_pixbuf_get_byte_length (pixbuf);
+	file_cache_insert (bg, ent);
+}
+
+static void
+file_cache_add_slide_show (MateBG *bg,
+			   const char *filename,
+			   SlideShow *show)
+{
+	FileCacheEntry *ent = file_cache_entry_new (SLIDESHOW, filename, 0, 0, -1);
+	ent->u.slideshow = slideshow_ref (show);
+	ent->size = slideshow_get_size (show);
+	file_cache_insert (bg, ent);
+}
+
+/* Process wide pool of decoded images, shared between all the MateBG
+ * instances of a process, so that e.g. the desktop and the appearance
+ * capplet do not each decode the same wallpaper. The pool does not own
+ * the pixbufs: entries only hold weak references and die with the last
+ * MateBG cache entry using them. */
+typedef struct {
+	char *filename;
+	gint width;
+	gint height;
+	gint placement;
+	GWeakRef pixbuf;
+} SharedPixbuf;
 
-static void
-file_cache_entry_delete (FileCacheEntry *ent)
+G_LOCK_DEFINE_STATIC (shared_pixbufs);
+static GHashTable *shared_pixbufs = NULL;
+
+static guint
+shared_pixbuf_hash (gconstpointer key)
 {
-	g_free (ent->filename);
+	const SharedPixbuf *shared = key;
+	guint hash;
 
-	switch (ent->type) {
-	case PIXBUF:
-		g_object_unref (ent->u.pixbuf);
-		break;
-	case SLIDESHOW:
-		slideshow_unref (ent->u.slideshow);
-		break;
-	case THUMBNAIL:
-		g_object_unref (ent->u.thumbnail);
-		break;
-	}
+	hash = g_str_hash (shared->filename);
+	hash = (hash * 31) + shared->width;
+	hash = (hash * 31) + shared->height;
+	hash = (hash * 31) + shared->placement;
 
-	g_free (ent);
+	return hash;
 }
 
-static void
-bound_cache (MateBG *bg)
+static gboolean
+shared_pixbuf_equal (gconstpointer a,
+		     gconstpointer b)
 {
-      while (g_list_length (bg->file_cache) >= CACHE_SIZE) {
-	      GList *last_link = g_list_last (bg->file_cache);
-	      FileCacheEntry *ent = last_link->data;
+	const SharedPixbuf *shared_a = a;
+	const SharedPixbuf *shared_b = b;
 
-	      file_cache_entry_delete (ent);
+	return shared_a->width == shared_b->width &&
+	       shared_a->height == shared_b->height &&
+	       shared_a->placement == shared_b->placement &&
+	       strcmp (shared_a->filename, shared_b->filename) == 0;
+}
 
-	      bg->file_cache = g_list_delete_link (bg->file_cache, last_link);
-      }
+static void
+shared_pixbuf_free (SharedPixbuf *shared)
+{
+	g_weak_ref_clear (&shared->pixbuf);
+	g_free (shared->filename);
+	g_free (shared);
 }
 
-static const FileCacheEntry *
-file_cache_lookup (MateBG *bg, FileType type, const char *filename)
+static gboolean
+shared_pixbuf_is_dead (gpointer key,
+		       gpointer value,
+		       gpointer user_data)
 {
-	GList *list;
+	SharedPixbuf *shared = value;
+	GdkPixbuf *pixbuf;
 
-	for (list = bg->file_cache; list != NULL; list = list->next) {
-		FileCacheEntry *ent = list->data;
+	pixbuf = g_weak_ref_get (&shared->pixbuf);
+	if (pixbuf == NULL)
+		return TRUE;
 
-		if (ent && ent->type == type &&
-		    strcmp (ent->filename, filename) == 0) {
-			return ent;
-		}
-	}
+	g_object_unref (pixbuf);
+	return FALSE;
+}
 
-	return NULL;
+static gboolean
+shared_pixbuf_has_filename (gpointer key,
+			    gpointer value,
+			    gpointer user_data)
+{
+	SharedPixbuf *shared = value;
+
+	return strcmp (shared->filename, user_data) == 0;
 }
 
-static FileCacheEntry *
-file_cache_entry_new (MateBG *bg,
-		      FileType type,
-		      const char *filename)
+/* Like the file cache, sized entries are preferred over full size
+ * ones. *sized tells which kind was found. */
+static GdkPixbuf *
+shared_pixbuf_lookup (const char      *filename,
+		      gint             width,
+		      gint             height,
+		      gint             placement,
+		      gboolean        *sized)
 {
-	FileCacheEntry *ent = g_new0 (FileCacheEntry, 1);
+	SharedPixbuf key;
+	SharedPixbuf *shared;
+	GdkPixbuf *pixbuf = NULL;
 
-	g_assert (!file_cache_lookup (bg, type, filename));
+	*sized = FALSE;
 
-	ent->type = type;
-	ent->filename = g_strdup (filename);
+	G_LOCK (shared_pixbufs);
 
-	bg->file_cache = g_list_prepend (bg->file_cache, ent);
+	if (shared_pixbufs != NULL) {
+		key.filename = (char *) filename;
+		key.width = width;
+		key.height = height;
+		key.placement = placement;
 
-	bound_cache (bg);
+		shared = g_hash_table_lookup (shared_pixbufs, &key);
+		if (shared != NULL)
+			pixbuf = g_weak_ref_get (&shared->pixbuf);
 
-	return ent;
-}
+		*sized = (pixbuf != NULL);
 
-static void
-file_cache_add_pixbuf (MateBG *bg,
-		       const char *filename,
-		       GdkPixbuf *pixbuf)
-{
-	FileCacheEntry *ent = file_cache_entry_new (bg, PIXBUF, filename);
-	ent->u.pixbuf = g_object_ref (pixbuf);
+		if (pixbuf == NULL) {
+			key.width = 0;
+			key.height = 0;
+			key.placement = -1;
+
+			shared = g_hash_table_lookup (shared_pixbufs, &key);
+			if (shared != NULL)
+				pixbuf = g_weak_ref_get (&shared->pixbuf);
+		}
+	}
+
+	G_UNLOCK (shared_pixbufs);
+
+	return pixbuf;
 }
 
+/* Size independent entries are added with a 0x0 size and a placement of -1 */
 static void
-file_cache_add_thumbnail (MateBG *bg,
-			  const char *filename,
-			  GdkPixbuf *pixbuf)
+shared_pixbuf_insert (const char *filename,
+		      gint        width,
+		      gint        height,
+		      gint        placement,
+		      GdkPixbuf  *pixbuf)
 {
-	FileCacheEntry *ent = file_cache_entry_new (bg, THUMBNAIL, filename);
-	ent->u.thumbnail = g_object_ref (pixbuf);
+	SharedPixbuf *shared;
+
+	shared = g_new0 (SharedPixbuf, 1);
+	shared->filename = g_strdup (filename);
+	shared->width = width;
+	shared->height = height;
+	shared->placement = placement;
+	g_weak_ref_init (&shared->pixbuf, pixbuf);
+
+	G_LOCK (shared_pixbufs);
+
+	if (shared_pixbufs == NULL) {
+		shared_pixbufs = g_hash_table_new_full (shared_pixbuf_hash,
+							shared_pixbuf_equal,
+							NULL,
+							(GDestroyNotify) shared_pixbuf_free);
+	} else {
+		/* drop the entries whose pixbufs are gone */
+		g_hash_table_foreach_remove (shared_pixbufs,
+					     shared_pixbuf_is_dead,
+					     NULL);
+	}
+
+	/* replaces any previous entry for the same key */
+	g_hash_table_remove (shared_pixbufs, shared);
+	g_hash_table_add (shared_pixbufs, shared);
+
+	G_UNLOCK (shared_pixbufs);
 }
 
+/* Makes sure that nobody picks up a stale image after @filename changed */
 static void
-file_cache_add_slide_show (MateBG *bg,
-			   const char *filename,
-			   SlideShow *show)
+shared_pixbuf_forget (const char *filename)
 {
-	FileCacheEntry *ent = file_cache_entry_new (bg, SLIDESHOW, filename);
-	ent->u.slideshow = slideshow_ref (show);
+	G_LOCK (shared_pixbufs);
+
+	if (shared_pixbufs != NULL)
+		g_hash_table_foreach_remove (shared_pixbufs,
+					     shared_pixbuf_has_filename,
+					     (gpointer) filename);
+
+	G_UNLOCK (shared_pixbufs);
 }
 
 static GdkPixbuf *
@@ -1898,20 +4501,148 @@ load_from_cache_file (MateBG     *bg,
 		      gint        best_width,
 		      gint        best_height)
 {
+	DiskCacheFormat format;
 	GdkPixbuf *pixbuf = NULL;
-	gchar *cache_filename;
+	gchar *cache_dir;
+	gchar *base;
+	gchar *name = NULL;
+	gchar *path;
+	FileStat stat;
+
+	/* slides are not monitored, the background file itself is */
+	if (g_strcmp0 (filename, bg->filename) == 0)
+		stat = *get_file_stat (bg);
+	else
+		file_stat_query (filename, &stat);
 
-	cache_filename = get_wallpaper_cache_filename (filename, num_monitor, bg->placement,
-							best_width, best_height);
+	base = disk_cache_entry_name (filename, &stat, bg->placement, best_width, best_height);
+	if (base == NULL)
+		return NULL;
+
+	cache_dir = get_wallpaper_cache_dir ();
+
+	G_LOCK (disk_cache);
+	disk_cache_ensure_loaded_locked (cache_dir);
+
+	/* the entry may have been stored with another format setting */
+	for (format = DISK_CACHE_FORMAT_RAW; format <= DISK_CACHE_FORMAT_PNG; format++) {
+		DiskCacheEntry *entry;
+
+		name = g_strdup_printf ("%s.%s", base, disk_cache_format_suffix (format));
+		entry = g_hash_table_lookup (disk_cache.entries, name);
+		if (entry) {
+			disk_cache_add_locked (name, entry->size,
+					       g_get_real_time () / G_USEC_PER_SEC);
+			break;
+		}
+
+		g_free (name);
+		name = NULL;
+	}
+	G_UNLOCK (disk_cache);
+
+	if (name) {
+		path = g_build_filename (cache_dir, name, NULL);
+
+		if (format == DISK_CACHE_FORMAT_RAW)
+			pixbuf = disk_cache_read_raw (path);
+		else
+			pixbuf = gdk_pixbuf_new_from_file (path, NULL);
+
+		/* gone or damaged: forget about it */
+		if (pixbuf == NULL) {
+			DiskCacheEntry *entry;
+
+			G_LOCK (disk_cache);
+			entry = g_hash_table_lookup (disk_cache.entries, name);
+			if (entry)
+				disk_cache_remove_locked (entry);
+			G_UNLOCK (disk_cache);
+
+			g_unlink (path);
+		}
 
-	if (cache_file_is_valid (filename, cache_filename))
-		pixbuf = gdk_pixbuf_new_from_file (cache_filename, NULL);
+		g_free (path);
+		g_free (name);
+	}
 
-	g_free (cache_filename);
+	g_free (cache_dir);
+	g_free (base);
 
 	return pixbuf;
 }
 
+/* Computes the smallest size an image of orig_width x orig_height can be
+ * decoded at, such that it can still be scaled to dest_width x dest_height
+ * with @placement without upscaling. Returns FALSE if the image has to be
+ * decoded at full size. */
+static gboolean
+get_decode_size (MateBGPlacement  placement,
+		 int              orig_width,
+		 int              orig_height,
+		 int              dest_width,
+		 int              dest_height,
+		 int             *width,
+		 int             *height)
+{
+	double factor, rotated_factor;
+
+	if (orig_width <= 0 || orig_height <= 0 ||
+	    dest_width <= 0 || dest_height <= 0)
+		return FALSE;
+
+	switch (placement) {
+	case MATE_BG_PLACEMENT_ZOOMED:
+	case MATE_BG_PLACEMENT_FILL_SCREEN:
+		factor = MAX (dest_width / (double) orig_width,
+			      dest_height / (double) orig_height);
+		rotated_factor = MAX (dest_height / (double) orig_width,
+				      dest_width / (double) orig_height);
+		break;
+
+	case MATE_BG_PLACEMENT_SCALED:
+	case MATE_BG_PLACEMENT_SPANNED:
+		factor = MIN (dest_width / (double) orig_width,
+			      dest_height / (double) orig_height);
+		rotated_factor = MIN (dest_height / (double) orig_width,
+				      dest_width / (double) orig_height);
+		break;
+
+	case MATE_BG_PLACEMENT_CENTERED:
+	case MATE_BG_PLACEMENT_TILED:
+	default:
+		/* shown unscaled */
+		return FALSE;
+	}
+
+	/* The embedded orientation is only applied after loading, so
+	 * make sure the image is large enough either way */
+	factor = MAX (factor, rotated_factor);
+	if (factor >= 1.0)
+		return FALSE;
+
+	*width = MAX (1, (int) ceil (orig_width * factor));
+	*height = MAX (1, (int) ceil (orig_height * factor));
+
+	return TRUE;
+}
+
+/* Images decoded at a smaller size than the file's, for one size of
+ * destination, are marked so that they are not used for larger ones */
+#define SIZED_DECODE_KEY "mate-bg-sized-decode"
+
+static void
+mark_sized_decode (GdkPixbuf *pixbuf)
+{
+	g_object_set_data (G_OBJECT (pixbuf), SIZED_DECODE_KEY, GINT_TO_POINTER (TRUE));
+}
+
+static gboolean
+is_sized_decode (GdkPixbuf *pixbuf)
+{
+	return g_object_get_data (G_OBJECT (pixbuf), SIZED_DECODE_KEY) != NULL;
+}
+
 static GdkPixbuf *
 get_as_pixbuf_for_size (MateBG    *bg,
 			const char *filename,
@@ -1920,22 +4651,45 @@ get_as_pixbuf_for_size (MateBG    *bg,
 			gint         best_height)
 {
 	const FileCacheEntry *ent;
-	if ((ent = file_cache_lookup (bg, PIXBUF, filename))) {
+
+	/* Scaled copies from the on-disk cache and images decoded at the
+	 * requested size are cached per size and placement, full size
+	 * decodes are shared between all of them. */
+	if ((ent = file_cache_lookup (bg, PIXBUF, filename, best_width, best_height))) {
 		return g_object_ref (ent->u.pixbuf);
 	} else {
 		GdkPixbufFormat *format;
 		GdkPixbuf *pixbuf = NULL;
 		gchar *tmp = NULL;
 		GdkPixbuf *tmp_pixbuf;
+		gboolean sized = FALSE;
+
+		/* Another MateBG of this process may have decoded it already */
+		pixbuf = shared_pixbuf_lookup (filename, best_width, best_height,
+					       bg->placement, &sized);
+		if (pixbuf) {
+			if (sized)
+				file_cache_add_pixbuf (bg, filename,
+						       best_width, best_height, pixbuf);
+			else
+				file_cache_add_pixbuf (bg, filename, 0, 0, pixbuf);
+
+			return pixbuf;
+		}
 
 		/* Try to hit local cache first if relevant */
 		if (monitor != -1)
 			pixbuf = load_from_cache_file (bg, filename, monitor,
 							best_width, best_height);
+		if (pixbuf)
+			sized = TRUE;
 
 		if (!pixbuf) {
+			int orig_width, orig_height;
+			int width, height;
+
 			/* If scalable choose maximum size */
-			format = gdk_pixbuf_get_file_info (filename, NULL, NULL);
+			format = gdk_pixbuf_get_file_info (filename, &orig_width, &orig_height);
 			if (format != NULL)
 				tmp = gdk_pixbuf_format_get_name (format);
 
@@ -1948,6 +4702,18 @@ get_as_pixbuf_for_size (MateBG    *bg,
 				pixbuf = gdk_pixbuf_new_from_file_at_size (filename,
 									   best_width,
 									   best_height, NULL);
+				sized = TRUE;
+			} else if (format != NULL &&
+				   get_decode_size (bg->placement,
+						    orig_width, orig_height,
+						    best_width, best_height,
+						    &width, &height)) {
+				/* Let the loader scale while decoding, which is
+				 * much cheaper for e.g. JPEG (DCT scaling) */
+				pixbuf = gdk_pixbuf_new_from_file_at_scale (filename,
+									    width, height,
+									    TRUE, NULL);
+				sized = TRUE;
 			} else {
 				pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
 			}
@@ -1960,7 +4726,16 @@ get_as_pixbuf_for_size (MateBG    *bg,
 			tmp_pixbuf = gdk_pixbuf_apply_embedded_orientation (pixbuf);
 			g_object_unref (pixbuf);
 			pixbuf = tmp_pixbuf;
-			file_cache_add_pixbuf (bg, filename, pixbuf);
+			if (sized) {
+				mark_sized_decode (pixbuf);
+				file_cache_add_pixbuf (bg, filename,
+						       best_width, best_height, pixbuf);
+				shared_pixbuf_insert (filename, best_width, best_height,
+						      bg->placement, pixbuf);
+			} else {
+				file_cache_add_pixbuf (bg, filename, 0, 0, pixbuf);
+				shared_pixbuf_insert (filename, 0, 0, -1, pixbuf);
+			}
 		}
 
 		return pixbuf;
@@ -1971,7 +4746,7 @@ static SlideShow *
 get_as_slideshow (MateBG *bg, const char *filename)
 {
 	const FileCacheEntry *ent;
-	if ((ent = file_cache_lookup (bg, SLIDESHOW, filename))) {
+	if ((ent = file_cache_lookup (bg, SLIDESHOW, filename, 0, 0))) {
 		return slideshow_ref (ent->u.slideshow);
 	}
 	else {
@@ -1984,11 +4759,24 @@ get_as_slideshow (MateBG *bg, const char *filename)
 	}
 }
 
+/* Like get_as_slideshow(), but never parses: returns NULL unless the
+ * slideshow is already in the cache. */
+static SlideShow *
+peek_slideshow (MateBG *bg, const char *filename)
+{
+	const FileCacheEntry *ent;
+
+	if ((ent = file_cache_lookup (bg, SLIDESHOW, filename, 0, 0)))
+		return slideshow_ref (ent->u.slideshow);
+
+	return NULL;
+}
+
 static GdkPixbuf *
 get_as_thumbnail (MateBG *bg, MateDesktopThumbnailFactory *factory, const char *filename)
 {
 	const FileCacheEntry *ent;
-	if ((ent = file_cache_lookup (bg, THUMBNAIL, filename))) {
+	if ((ent = file_cache_lookup (bg, THUMBNAIL, filename, 0, 0))) {
 		return g_object_ref (ent->u.thumbnail);
 	}
 	else {
@@ -2009,15 +4797,12 @@ blow_expensive_caches (gpointer data)
 
 	bg->blow_caches_id = 0;
 
-	for (list = bg->file_cache; list != NULL; list = next) {
+	for (list = bg->file_cache_lru.head; list != NULL; list = next) {
 		FileCacheEntry *ent = list->data;
 		next = list->next;
 
-		if (ent->type == PIXBUF) {
-			file_cache_entry_delete (ent);
-			bg->file_cache = g_list_delete_link (bg->file_cache,
-							     list);
-		}
+		if (ent->type == PIXBUF || ent->type == SCALED || ent->type == PLACED)
+			file_cache_remove (bg, ent);
 	}
 
 	if (bg->pixbuf_cache) {
@@ -2025,12 +4810,17 @@ blow_expensive_caches (gpointer data)
 		bg->pixbuf_cache = NULL;
 	}
 
+	g_clear_pointer (&bg->transitions, g_ptr_array_unref);
+
 	return FALSE;
 }
 
 static void
 blow_expensive_caches_in_idle (MateBG *bg)
 {
+	if (bg->render_copy)
+		return;
+
 	if (bg->blow_caches_id == 0) {
 		bg->blow_caches_id =
 			g_idle_add (blow_expensive_caches,
@@ -2050,42 +4840,236 @@ on_timeout (gpointer data)
 	return FALSE;
 }
 
-static double
-get_slide_timeout (Slide   *slide)
-{
-	double timeout;
-	if (slide->fixed) {
-		timeout = slide->duration;
-	} else {
-		/* Maybe the number of steps should be configurable? */
-
-		/* In the worst case we will do a fade from 0 to 256, which mean
-		 * we will never use more than 255 steps, however in most cases
-		 * the first and last value are similar and users can't percieve
-		 * changes in pixel values as small as 1/255th. So, lets not waste
-		 * CPU cycles on transitioning to often.
-		 *
-		 * 64 steps is enough for each step to be just detectable in a 16bit
-		 * color mode in the worst case, so we'll use this as an approximation
-		 * of whats detectable.
-		 */
-		timeout = slide->duration / 64.0;
-	}
-	return timeout;
+/* Shortly before the slideshow timer fires, the images of the slide it
+ * will show are decoded in a worker thread, for the sizes the slideshow
+ * was drawn at, so that the redraw does not stall on them. */
+#define PREFETCH_AHEAD_SECS 10
+#define PREFETCH_MAX_SIZES 8
+
+typedef struct {
+	gint monitor;
+	gint width;
+	gint height;
+} PrefetchSize;
+
+typedef struct {
+	char *filename;
+	PrefetchSize size;
+} PrefetchItem;
+
+typedef struct {
+	MateBG *copy;
+	GArray *items;
+} PrefetchData;
+
+static void
+record_prefetch_size (MateBG *bg,
+		      gint    monitor,
+		      gint    width,
+		      gint    height)
+{
+	PrefetchSize size;
+	guint i;
+
+	if (bg->render_copy)
+		return;
+
+	if (!bg->prefetch_sizes)
+		bg->prefetch_sizes = g_array_new (FALSE, FALSE, sizeof (PrefetchSize));
+
+	for (i = 0; i < bg->prefetch_sizes->len; i++) {
+		PrefetchSize *old = &g_array_index (bg->prefetch_sizes, PrefetchSize, i);
+
+		if (old->monitor == monitor &&
+		    old->width == width &&
+		    old->height == height)
+			return;
+	}
+
+	if (bg->prefetch_sizes->len == PREFETCH_MAX_SIZES)
+		g_array_remove_index (bg->prefetch_sizes, 0);
+
+	size.monitor = monitor;
+	size.width = width;
+	size.height = height;
+	g_array_append_val (bg->prefetch_sizes, size);
+}
+
+static void
+prefetch_item_clear (gpointer data)
+{
+	PrefetchItem *item = data;
+
+	g_free (item->filename);
+}
+
+static void
+prefetch_data_free (PrefetchData *data)
+{
+	g_object_unref (data->copy);
+	g_array_unref (data->items);
+	g_free (data);
+}
+
+static void
+prefetch_add (MateBG             *bg,
+	      GArray             *items,
+	      GSList             *sizes,
+	      const PrefetchSize *size)
+{
+	PrefetchItem item;
+	FileSize *best;
+
+	best = find_best_size (sizes, size->width, size->height);
+	if (!best || file_cache_find (bg, PIXBUF, best->file, size->width, size->height))
+		return;
+
+	item.filename = g_strdup (best->file);
+	item.size = *size;
+	g_array_append_val (items, item);
+}
+
+static void
+prefetch_thread (GTask        *task,
+		 gpointer      source_object,
+		 gpointer      task_data,
+		 GCancellable *cancellable)
+{
+	PrefetchData *data = task_data;
+	guint i;
+
+	for (i = 0; i < data->items->len; i++) {
+		PrefetchItem *item = &g_array_index (data->items, PrefetchItem, i);
+		GdkPixbuf *pixbuf;
+
+		if (g_task_return_error_if_cancelled (task))
+			return;
+
+		pixbuf = get_as_pixbuf_for_size (data->copy, item->filename,
+						 item->size.monitor,
+						 item->size.width,
+						 item->size.height);
+		if (pixbuf)
+			g_object_unref (pixbuf);
+	}
+
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+prefetch_done (GObject      *source_object,
+	       GAsyncResult *result,
+	       gpointer      user_data)
+{
+	MateBG *bg = MATE_BG (source_object);
+	GTask *task = G_TASK (result);
+	PrefetchData *data;
+
+	if (g_task_get_cancellable (task) == bg->prefetch_cancellable)
+		g_clear_object (&bg->prefetch_cancellable);
+
+	/* fails if cancelled */
+	if (!g_task_propagate_boolean (task, NULL))
+		return;
+
+	data = g_task_get_task_data (task);
+	file_cache_adopt_pixbufs (bg, data->copy);
+}
+
+static void
+start_prefetch (MateBG *bg)
+{
+	PrefetchData *data;
+	SlideShow *show;
+	Slide *slide;
+	GArray *items;
+	GTask *task;
+	guint i;
+
+	if (!bg->filename || !bg->prefetch_sizes || bg->prefetch_cancellable)
+		return;
+
+	show = peek_slideshow (bg, bg->filename);
+	if (!show)
+		return;
+
+	slide = get_slide_state (show, bg->prefetch_time, NULL, NULL);
+
+	items = g_array_new (FALSE, FALSE, sizeof (PrefetchItem));
+	g_array_set_clear_func (items, prefetch_item_clear);
+
+	for (i = 0; i < bg->prefetch_sizes->len; i++) {
+		PrefetchSize *size = &g_array_index (bg->prefetch_sizes, PrefetchSize, i);
+
+		prefetch_add (bg, items, slide->file1, size);
+		if (!slide->fixed)
+			prefetch_add (bg, items, slide->file2, size);
+	}
+
+	slideshow_unref (show);
+
+	if (items->len == 0) {
+		g_array_unref (items);
+		return;
+	}
+
+	data = g_new0 (PrefetchData, 1);
+	data->copy = mate_bg_copy_for_render (bg);
+	data->items = items;
+
+	bg->prefetch_cancellable = g_cancellable_new ();
+
+	task = g_task_new (bg, bg->prefetch_cancellable, prefetch_done, NULL);
+	g_task_set_source_tag (task, start_prefetch);
+	g_task_set_priority (task, G_PRIORITY_LOW);
+	g_task_set_task_data (task, data, (GDestroyNotify) prefetch_data_free);
+	g_task_run_in_thread (task, prefetch_thread);
+	g_object_unref (task);
+}
+
+static gboolean
+on_prefetch (gpointer data)
+{
+	MateBG *bg = data;
+
+	bg->prefetch_id = 0;
+
+	start_prefetch (bg);
+
+	return FALSE;
+}
+
+static void
+queue_prefetch (MateBG *bg,
+		double  timeout)
+{
+	double delay;
+
+	if (bg->prefetch_id)
+		g_source_remove (bg->prefetch_id);
+
+	bg->prefetch_time = now () + timeout;
+	delay = MAX (timeout - PREFETCH_AHEAD_SECS, 0);
+
+	bg->prefetch_id = g_timeout_add_full (G_PRIORITY_LOW,
+					      delay * 1000, on_prefetch, bg, NULL);
 }
 
 static void
 ensure_timeout (MateBG *bg,
-		Slide   *slide)
+		double  timeout)
 {
-	if (!bg->timeout_id) {
-		double timeout = get_slide_timeout (slide);
+	if (bg->render_copy)
+		return;
 
+	if (!bg->timeout_id) {
 		/* G_MAXUINT means "only one slide" */
 		if (timeout < G_MAXUINT) {
 			bg->timeout_id = g_timeout_add_full (
 				G_PRIORITY_LOW,
 				timeout * 1000, on_timeout, bg, NULL);
+
+			queue_prefetch (bg, timeout);
 		}
 
 	}
@@ -2225,12 +5209,15 @@ create_img_thumbnail (MateBG                      *bg,
 
 			if (show) {
 				double alpha;
+				double timeout;
 				Slide *slide;
 
-				if (frame_num == -1)
-					slide = get_current_slide (show, &alpha);
-				else
-					slide = g_queue_peek_nth (show->slides, frame_num);
+				if (frame_num == -1) {
+					slide = get_current_slide (show, &alpha, &timeout);
+				} else {
+					slide = g_ptr_array_index (show->slides, frame_num);
+					timeout = slide->step;
+				}
 
 				if (slide->fixed) {
 					GdkPixbuf *tmp;
@@ -2284,7 +5271,7 @@ create_img_thumbnail (MateBG                      *bg,
 						g_object_unref (p2);
 				}
 
-				ensure_timeout (bg, slide);
+				ensure_timeout (bg, timeout);
 
 				slideshow_unref (show);
 			}
@@ -2350,12 +5337,15 @@ get_pixbuf_for_size (MateBG *bg,
 	guint time_until_next_change;
 	gboolean hit_cache = FALSE;
 
-	/* only hit the cache if the aspect ratio matches */
+	/* only hit the cache if the aspect ratio matches, and if it was
+	 * decoded at a smaller size, only if that is large enough */
 	if (bg->pixbuf_cache) {
 		int width, height;
 		width = gdk_pixbuf_get_width (bg->pixbuf_cache);
 		height = gdk_pixbuf_get_height (bg->pixbuf_cache);
 		hit_cache = 0.2 > fabs ((best_width / (double)best_height) - (width / (double)height));
+		if (hit_cache && is_sized_decode (bg->pixbuf_cache))
+			hit_cache = width >= best_width && height >= best_height;
 		if (!hit_cache) {
 			g_object_unref (bg->pixbuf_cache);
 			bg->pixbuf_cache = NULL;
@@ -2363,10 +5353,10 @@ get_pixbuf_for_size (MateBG *bg,
 	}
 
 	if (!hit_cache && bg->filename) {
-		bg->file_mtime = get_mtime (bg->filename);
-
 		bg->pixbuf_cache = get_as_pixbuf_for_size (bg, bg->filename, monitor,
 							   best_width, best_height);
+		g_free (bg->pixbuf_cache_source);
+		bg->pixbuf_cache_source = bg->pixbuf_cache ? g_strdup (bg->filename) : NULL;
 		time_until_next_change = G_MAXUINT;
 		if (!bg->pixbuf_cache) {
 			SlideShow *show = get_as_slideshow (bg, bg->filename);
@@ -2378,15 +5368,23 @@ get_pixbuf_for_size (MateBG *bg,
 
 				slideshow_ref (show);
 
-				slide = get_current_slide (show, &alpha);
-				timeout = get_slide_timeout (slide);
+				record_prefetch_size (bg, monitor,
+						      best_width, best_height);
+
+				slide = get_current_slide (show, &alpha, &timeout);
 				time_until_next_change = (guint) timeout;
 				if (slide->fixed) {
 					FileSize *size = find_best_size (slide->file1,
 									 best_width, best_height);
+
+					/* no transition in progress */
+					g_clear_pointer (&bg->transitions, g_ptr_array_unref);
+
 					bg->pixbuf_cache =
 						get_as_pixbuf_for_size (bg, size->file, monitor,
 									best_width, best_height);
+					if (bg->pixbuf_cache)
+						bg->pixbuf_cache_source = g_strdup (size->file);
 				} else {
 					FileSize *size;
 					GdkPixbuf *p1, *p2;
@@ -2401,15 +5399,19 @@ get_pixbuf_for_size (MateBG *bg,
 					p2 = get_as_pixbuf_for_size (bg, size->file, monitor,
 								     best_width, best_height);
 
-					if (p1 && p2)
-						bg->pixbuf_cache = blend (p1, p2, alpha);
+					if (p1 && p2) {
+						bg->pixbuf_cache = transition_render (bg, p1, p2, alpha);
+						/* frames have the size of @p1 */
+						if (bg->pixbuf_cache && is_sized_decode (p1))
+							mark_sized_decode (bg->pixbuf_cache);
+					}
 					if (p1)
 						g_object_unref (p1);
 					if (p2)
 						g_object_unref (p2);
 				}
 
-				ensure_timeout (bg, slide);
+				ensure_timeout (bg, timeout);
 
 				slideshow_unref (show);
 			}
@@ -2442,10 +5444,12 @@ is_different (MateBG    *bg,
 		return FALSE;
 	}
 	else {
-		if (get_mtime (filename) != bg->file_mtime)
+		if (strcmp (filename, bg->filename) != 0)
 			return TRUE;
 
-		if (strcmp (filename, bg->filename) != 0)
+		/* changes of the file itself are reported by the monitor */
+		if (bg->file_monitor == NULL &&
+		    get_mtime (filename) != bg->file_mtime)
 			return TRUE;
 
 		return FALSE;
@@ -2455,17 +5459,11 @@ is_different (MateBG    *bg,
 static void
 clear_cache (MateBG *bg)
 {
-	GList *list;
-
-	if (bg->file_cache) {
-		for (list = bg->file_cache; list != NULL; list = list->next) {
-			FileCacheEntry *ent = list->data;
-
-			file_cache_entry_delete (ent);
-		}
-		g_list_free (bg->file_cache);
-		bg->file_cache = NULL;
-	}
+	/* The LRU links are embedded in the entries, which are freed
+	 * by the hash table, so just forget about them. */
+	g_hash_table_remove_all (bg->file_cache);
+	g_queue_init (&bg->file_cache_lru);
+	bg->file_cache_bytes = 0;
 
 	if (bg->pixbuf_cache) {
 		g_object_unref (bg->pixbuf_cache);
@@ -2478,72 +5476,297 @@ clear_cache (MateBG *bg)
 
 		bg->timeout_id = 0;
 	}
+
+	if (bg->prefetch_id) {
+		g_source_remove (bg->prefetch_id);
+
+		bg->prefetch_id = 0;
+	}
+
+	if (bg->prefetch_cancellable) {
+		g_cancellable_cancel (bg->prefetch_cancellable);
+		g_clear_object (&bg->prefetch_cancellable);
+	}
+
+	g_clear_pointer (&bg->prefetch_sizes, g_array_unref);
+	g_clear_pointer (&bg->transitions, g_ptr_array_unref);
 }
 
 /* Pixbuf utilities */
+
+/* Channel sums of a pixbuf; with alpha, the colour channels are
+ * weighted by it. */
+typedef struct {
+	guint64 r;
+	guint64 g;
+	guint64 b;
+	guint64 a;
+} PixelTotals;
+
+typedef void (*SumRowFunc) (const guchar *p,
+			    guint         width,
+			    PixelTotals  *totals);
+
+static void
+sum_row_rgb (const guchar *p,
+	     guint         width,
+	     PixelTotals  *totals)
+{
+	guint column;
+
+	for (column = 0; column < width; column++) {
+		totals->r += *p++;
+		totals->g += *p++;
+		totals->b += *p++;
+	}
+}
+
+static void
+sum_row_rgba (const guchar *p,
+	      guint         width,
+	      PixelTotals  *totals)
+{
+	guint column;
+	int a;
+
+	for (column = 0; column < width; column++) {
+		a = p[3];
+
+		totals->r += p[0] * a;
+		totals->g += p[1] * a;
+		totals->b += p[2] * a;
+		totals->a += a;
+		p += 4;
+	}
+}
+
+#if defined(__SSE2__)
+/* 16 pixels (three vectors) at a time: each vector is masked down to one
+ * channel and summed with _mm_sad_epu8(). */
+static void
+sum_row_rgb_sse2 (const guchar *p,
+		  guint         width,
+		  PixelTotals  *totals)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i mask[3][3]; /* [vector][channel] */
+	__m128i acc[3];
+	guint64 sums[2];
+	guchar bytes[16];
+	guint column;
+	int v, c, i;
+
+	for (v = 0; v < 3; v++) {
+		for (c = 0; c < 3; c++) {
+			for (i = 0; i < 16; i++)
+				bytes[i] = ((v * 16 + i) % 3 == c) ? 0xFF : 0;
+			mask[v][c] = _mm_loadu_si128 ((const __m128i *) bytes);
+		}
+	}
+
+	acc[0] = acc[1] = acc[2] = zero;
+
+	for (column = 0; column + 16 <= width; column += 16, p += 48) {
+		for (v = 0; v < 3; v++) {
+			__m128i px = _mm_loadu_si128 ((const __m128i *) (p + v * 16));
+
+			for (c = 0; c < 3; c++)
+				acc[c] = _mm_add_epi64 (acc[c],
+							_mm_sad_epu8 (_mm_and_si128 (px, mask[v][c]), zero));
+		}
+	}
+
+	_mm_storeu_si128 ((__m128i *) sums, acc[0]);
+	totals->r += sums[0] + sums[1];
+	_mm_storeu_si128 ((__m128i *) sums, acc[1]);
+	totals->g += sums[0] + sums[1];
+	_mm_storeu_si128 ((__m128i *) sums, acc[2]);
+	totals->b += sums[0] + sums[1];
+
+	sum_row_rgb (p, width - column, totals);
+}
+
+/* 4 pixels at a time, widened to 16 bits and multiplied by their alpha
+ * (and the alpha channel by 1); the products are accumulated in 32 bit
+ * lanes, which are flushed often enough not to overflow. */
+#define SUM_RGBA_FLUSH_PIXELS 16384
+
+static void
+sum_row_rgba_sse2 (const guchar *p,
+		   guint         width,
+		   PixelTotals  *totals)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i rgb_mask = _mm_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i alpha_one = _mm_set_epi16 (1, 0, 0, 0, 1, 0, 0, 0);
+	guint32 sums[4];
+	guint column = 0;
+
+	while (column + 4 <= width) {
+		__m128i acc = zero;
+		guint end = MIN (width, column + SUM_RGBA_FLUSH_PIXELS);
+
+		for (; column + 4 <= end; column += 4, p += 16) {
+			__m128i px = _mm_loadu_si128 ((const __m128i *) p);
+			__m128i halves[2];
+			int h;
+
+			halves[0] = _mm_unpacklo_epi8 (px, zero);
+			halves[1] = _mm_unpackhi_epi8 (px, zero);
+
+			for (h = 0; h < 2; h++) {
+				__m128i alpha, prod;
+
+				alpha = _mm_shufflelo_epi16 (halves[h], _MM_SHUFFLE (3, 3, 3, 3));
+				alpha = _mm_shufflehi_epi16 (alpha, _MM_SHUFFLE (3, 3, 3, 3));
+				alpha = _mm_or_si128 (_mm_and_si128 (alpha, rgb_mask), alpha_one);
+
+				prod = _mm_mullo_epi16 (halves[h], alpha);
+				acc = _mm_add_epi32 (acc, _mm_unpacklo_epi16 (prod, zero));
+				acc = _mm_add_epi32 (acc, _mm_unpackhi_epi16 (prod, zero));
+			}
+		}
+
+		_mm_storeu_si128 ((__m128i *) sums, acc);
+		totals->r += sums[0];
+		totals->g += sums[1];
+		totals->b += sums[2];
+		totals->a += sums[3];
+	}
+
+	sum_row_rgba (p, width - column, totals);
+}
+#endif /* __SSE2__ */
+
+#if defined(MATE_BG_AVX2_DISPATCH)
+/* Same as sum_row_rgb_sse2(), 32 pixels at a time */
+__attribute__((target ("avx2")))
+static void
+sum_row_rgb_avx2 (const guchar *p,
+		  guint         width,
+		  PixelTotals  *totals)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	__m256i mask[3][3]; /* [vector][channel] */
+	__m256i acc[3];
+	guint64 sums[4];
+	guchar bytes[32];
+	guint column;
+	int v, c, i;
+
+	for (v = 0; v < 3; v++) {
+		for (c = 0; c < 3; c++) {
+			for (i = 0; i < 32; i++)
+				bytes[i] = ((v * 32 + i) % 3 == c) ? 0xFF : 0;
+			mask[v][c] = _mm256_loadu_si256 ((const __m256i *) bytes);
+		}
+	}
+
+	acc[0] = acc[1] = acc[2] = zero;
+
+	for (column = 0; column + 32 <= width; column += 32, p += 96) {
+		for (v = 0; v < 3; v++) {
+			__m256i px = _mm256_loadu_si256 ((const __m256i *) (p + v * 32));
+
+			for (c = 0; c < 3; c++)
+				acc[c] = _mm256_add_epi64 (acc[c],
+							   _mm256_sad_epu8 (_mm256_and_si256 (px, mask[v][c]), zero));
+		}
+	}
+
+	_mm256_storeu_si256 ((__m256i *) sums, acc[0]);
+	totals->r += sums[0] + sums[1] + sums[2] + sums[3];
+	_mm256_storeu_si256 ((__m256i *) sums, acc[1]);
+	totals->g += sums[0] + sums[1] + sums[2] + sums[3];
+	_mm256_storeu_si256 ((__m256i *) sums, acc[2]);
+	totals->b += sums[0] + sums[1] + sums[2] + sums[3];
+
+	sum_row_rgb (p, width - column, totals);
+}
+#endif /* MATE_BG_AVX2_DISPATCH */
+
+static SumRowFunc
+get_sum_row_func (gboolean has_alpha)
+{
+	if (has_alpha) {
+#if defined(__SSE2__)
+		return sum_row_rgba_sse2;
+#else
+		return sum_row_rgba;
+#endif
+	}
+
+#if defined(MATE_BG_AVX2_DISPATCH)
+	if (__builtin_cpu_supports ("avx2"))
+		return sum_row_rgb_avx2;
+#endif
+#if defined(__SSE2__)
+	return sum_row_rgb_sse2;
+#else
+	return sum_row_rgb;
+#endif
+}
+
+/* With @max_samples > 0, only every n-th row is looked at, so that at most
+ * about @max_samples pixels are summed. The result is kept on the pixbuf,
+ * so asking again for the same pixbuf is free. */
 static void
 pixbuf_average_value (GdkPixbuf *pixbuf,
+		      gsize      max_samples,
                       GdkRGBA   *result)
 {
-	guint64 a_total, r_total, g_total, b_total;
-	guint row, column;
+	PixelTotals totals = { 0, 0, 0, 0 };
+	SumRowFunc sum_row;
+	GdkRGBA *cached;
+	guint row, row_step, rows;
 	int row_stride;
-	const guchar *pixels, *p;
-	int r, g, b, a;
+	const guchar *pixels;
 	guint64 dividend;
 	guint width, height;
 	gdouble dd;
 
+	cached = g_object_get_data (G_OBJECT (pixbuf), "mate-bg-average-value");
+	if (cached) {
+		*result = *cached;
+		return;
+	}
+
 	width = gdk_pixbuf_get_width (pixbuf);
 	height = gdk_pixbuf_get_height (pixbuf);
 	row_stride = gdk_pixbuf_get_rowstride (pixbuf);
 	pixels = gdk_pixbuf_get_pixels (pixbuf);
 
-	/* iterate through the pixbuf, counting up each component */
-	a_total = 0;
-	r_total = 0;
-	g_total = 0;
-	b_total = 0;
+	row_step = 1;
+	if (max_samples > 0 && (gsize) width * height > max_samples)
+		row_step = (guint) (((gsize) width * height + max_samples - 1) / max_samples);
+	row_step = MIN (row_step, height);
+
+	/* iterate through the sampled rows, counting up each component */
+	sum_row = get_sum_row_func (gdk_pixbuf_get_has_alpha (pixbuf));
+	rows = 0;
+	for (row = 0; row < height; row += row_step) {
+		sum_row (pixels + (gsize) row * row_stride, width, &totals);
+		rows++;
+	}
 
 	if (gdk_pixbuf_get_has_alpha (pixbuf)) {
-		for (row = 0; row < height; row++) {
-			p = pixels + (row * row_stride);
-			for (column = 0; column < width; column++) {
-				r = *p++;
-				g = *p++;
-				b = *p++;
-				a = *p++;
-
-				a_total += a;
-				r_total += r * a;
-				g_total += g * a;
-				b_total += b * a;
-			}
-		}
-		dividend = height * width * 0xFF;
-		a_total *= 0xFF;
+		dividend = (guint64) rows * width * 0xFF;
+		totals.a *= 0xFF;
 	} else {
-		for (row = 0; row < height; row++) {
-			p = pixels + (row * row_stride);
-			for (column = 0; column < width; column++) {
-				r = *p++;
-				g = *p++;
-				b = *p++;
-
-				r_total += r;
-				g_total += g;
-				b_total += b;
-			}
-		}
-		dividend = height * width;
-		a_total = dividend * 0xFF;
+		dividend = (guint64) rows * width;
+		totals.a = dividend * 0xFF;
 	}
 
 	dd = dividend * 0xFF;
-	result->alpha = a_total / dd;
-	result->red = r_total / dd;
-	result->green = g_total / dd;
-	result->blue = b_total / dd;
+	result->alpha = totals.a / dd;
+	result->red = totals.r / dd;
+	result->green = totals.g / dd;
+	result->blue = totals.b / dd;
+
+	cached = g_new (GdkRGBA, 1);
+	*cached = *result;
+	g_object_set_data_full (G_OBJECT (pixbuf), "mate-bg-average-value",
+				cached, g_free);
 }
 
 static GdkPixbuf *
@@ -2604,19 +5827,46 @@ create_gradient (const GdkRGBA *primary,
 		 int	         n_pixels)
 {
 	guchar *result = g_malloc (n_pixels * 3);
-	int i;
-
-	for (i = 0; i < n_pixels; ++i) {
-		double ratio = (i + 0.5) / n_pixels;
-
-		result[3 * i + 0] = (guchar) ((primary->red * (1 - ratio) + secondary->red * ratio) * 0x100);
-		result[3 * i + 1] = (guchar) ((primary->green * (1 - ratio) + secondary->green * ratio) * 0x100);
-		result[3 * i + 2] = (guchar) ((primary->blue * (1 - ratio) + secondary->blue * ratio) * 0x100);
+	const double c1[3] = { primary->red, primary->green, primary->blue };
+	const double c2[3] = { secondary->red, secondary->green, secondary->blue };
+	int i, k;
+
+	/* Walk each channel in 16.16 fixed point, sampling at the pixel
+	 * centres as (i + 0.5) / n_pixels */
+	for (k = 0; k < 3; k++) {
+		gint64 start = (gint64) (c1[k] * 0x100 * 0x10000);
+		gint64 end = (gint64) (c2[k] * 0x100 * 0x10000);
+		gint64 step = (end - start) / n_pixels;
+		gint64 value = start + step / 2;
+
+		for (i = 0; i < n_pixels; i++) {
+			result[3 * i + k] = (guchar) CLAMP (value >> 16, 0, 0xFF);
+			value += step;
+		}
 	}
 
 	return result;
 }
 
+/* Fills @n_pixels pixels at @dest with the @n_channels bytes at @pixel,
+ * doubling the filled part with each memcpy() */
+static void
+fill_row (guchar       *dest,
+	  const guchar *pixel,
+	  int           n_channels,
+	  int           n_pixels)
+{
+	gsize total = (gsize) n_pixels * n_channels;
+	gsize filled;
+
+	if (n_pixels <= 0)
+		return;
+
+	memcpy (dest, pixel, n_channels);
+	for (filled = n_channels; filled < total; filled *= 2)
+		memcpy (dest + filled, dest, MIN (filled, total - filled));
+}
+
 static void
 pixbuf_draw_gradient (GdkPixbuf    *pixbuf,
 		      gboolean      horizontal,
@@ -2652,18 +5902,8 @@ pixbuf_draw_gradient (GdkPixbuf    *pixbuf,
 
 		gradient = create_gradient (primary, secondary, height);
 		for (i = 0; i < height; i++) {
-			int j;
-			guchar *d;
-
-			d = dst + rowstride * i;
 			gb = gradient + n_channels * i;
-			for (j = width; j > 0; j--) {
-				int k;
-
-				for (k = 0; k < n_channels; k++) {
-					*(d++) = gb[k];
-				}
-			}
+			fill_row (dst + rowstride * i, gb, n_channels, width);
 		}
 
 		g_free (gradient);
@@ -2714,6 +5954,96 @@ pixbuf_blend (GdkPixbuf *src,
 			      alpha * 0xFF + 0.5);
 }
 
+/* Whether pixbuf_lerp() can be used instead of compositing @p2 over @p1 */
+static gboolean
+pixbuf_can_lerp (GdkPixbuf *p1,
+		 GdkPixbuf *p2)
+{
+	return !gdk_pixbuf_get_has_alpha (p1) &&
+	       !gdk_pixbuf_get_has_alpha (p2) &&
+	       gdk_pixbuf_get_bits_per_sample (p1) == 8 &&
+	       gdk_pixbuf_get_bits_per_sample (p2) == 8 &&
+	       gdk_pixbuf_get_width (p1) == gdk_pixbuf_get_width (p2) &&
+	       gdk_pixbuf_get_height (p1) == gdk_pixbuf_get_height (p2);
+}
+
+/* out = (a * (255 - weight) + b * weight) / 255, rounded, for each byte;
+ * the arithmetic of gdk_pixbuf_composite() for opaque images */
+static void
+lerp_row (const guchar *a,
+	  const guchar *b,
+	  guchar       *out,
+	  gsize         n,
+	  guint         weight)
+{
+	gsize i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i wa = _mm_set1_epi16 (255 - weight);
+	const __m128i wb = _mm_set1_epi16 (weight);
+	const __m128i half = _mm_set1_epi16 (128);
+
+	/* everything fits in 16 bits unsigned: 255 * 255 + 128 + 254 */
+	for (; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128 ((const __m128i *) (a + i));
+		__m128i vb = _mm_loadu_si128 ((const __m128i *) (b + i));
+		__m128i lo, hi;
+
+		lo = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (va, zero), wa),
+				    _mm_mullo_epi16 (_mm_unpacklo_epi8 (vb, zero), wb));
+		hi = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (va, zero), wa),
+				    _mm_mullo_epi16 (_mm_unpackhi_epi8 (vb, zero), wb));
+
+		lo = _mm_add_epi16 (lo, half);
+		hi = _mm_add_epi16 (hi, half);
+		lo = _mm_srli_epi16 (_mm_add_epi16 (lo, _mm_srli_epi16 (lo, 8)), 8);
+		hi = _mm_srli_epi16 (_mm_add_epi16 (hi, _mm_srli_epi16 (hi, 8)), 8);
+
+		_mm_storeu_si128 ((__m128i *) (out + i), _mm_packus_epi16 (lo, hi));
+	}
+#endif
+
+	for (; i < n; i++) {
+		guint t = a[i] * (255 - weight) + b[i] * weight + 128;
+
+		out[i] = (t + (t >> 8)) >> 8;
+	}
+}
+
+/* Renders the cross fade of opaque @p1 and @p2 at @alpha into @dest,
+ * all three of the same size; equivalent to compositing @p2 over a
+ * copy of @p1 with pixbuf_blend(). */
+static void
+pixbuf_lerp (GdkPixbuf *p1,
+	     GdkPixbuf *p2,
+	     GdkPixbuf *dest,
+	     double     alpha)
+{
+	int width = gdk_pixbuf_get_width (dest);
+	int height = gdk_pixbuf_get_height (dest);
+	int n_channels = gdk_pixbuf_get_n_channels (dest);
+	int stride1 = gdk_pixbuf_get_rowstride (p1);
+	int stride2 = gdk_pixbuf_get_rowstride (p2);
+	int dest_stride = gdk_pixbuf_get_rowstride (dest);
+	const guchar *pixels1 = gdk_pixbuf_get_pixels (p1);
+	const guchar *pixels2 = gdk_pixbuf_get_pixels (p2);
+	guchar *dest_pixels = gdk_pixbuf_get_pixels (dest);
+	guint weight;
+	int y;
+
+	/* the overall alpha pixbuf_blend() would pass */
+	weight = (guint) (CLAMP (alpha, 0.0, 1.0) * 0xFF + 0.5);
+
+	for (y = 0; y < height; y++) {
+		lerp_row (pixels1 + y * stride1,
+			  pixels2 + y * stride2,
+			  dest_pixels + y * dest_stride,
+			  (gsize) width * n_channels,
+			  weight);
+	}
+}
+
 static void
 pixbuf_tile (GdkPixbuf *src, GdkPixbuf *dest)
 {
@@ -2725,6 +6055,35 @@ pixbuf_tile (GdkPixbuf *src, GdkPixbuf *dest)
 	tile_width = gdk_pixbuf_get_width (src);
 	tile_height = gdk_pixbuf_get_height (src);
 
+	if (!gdk_pixbuf_get_has_alpha (src) &&
+	    gdk_pixbuf_get_n_channels (src) == gdk_pixbuf_get_n_channels (dest)) {
+		/* Opaque: no compositing needed, build the first band of
+		 * tiles with doubling copies, then repeat it downwards */
+		int n_channels = gdk_pixbuf_get_n_channels (dest);
+		int src_stride = gdk_pixbuf_get_rowstride (src);
+		int dest_stride = gdk_pixbuf_get_rowstride (dest);
+		const guchar *src_pixels = gdk_pixbuf_get_pixels (src);
+		guchar *dest_pixels = gdk_pixbuf_get_pixels (dest);
+		gsize row_bytes = (gsize) dest_width * n_channels;
+		gsize tile_bytes = (gsize) MIN (tile_width, dest_width) * n_channels;
+
+		for (y = 0; y < dest_height; y++) {
+			guchar *d = dest_pixels + (gsize) y * dest_stride;
+			gsize filled;
+
+			if (y >= tile_height) {
+				memcpy (d, d - (gsize) tile_height * dest_stride, row_bytes);
+				continue;
+			}
+
+			memcpy (d, src_pixels + (gsize) y * src_stride, tile_bytes);
+			for (filled = tile_bytes; filled < row_bytes; filled *= 2)
+				memcpy (d + filled, d, MIN (filled, row_bytes - filled));
+		}
+
+		return;
+	}
+
 	for (y = 0; y < dest_height; y += tile_height) {
 		for (x = 0; x < dest_width; x += tile_width) {
 			pixbuf_blend (src, dest, 0, 0,
@@ -2753,10 +6112,10 @@ handle_start_element (GMarkupParseContext *context,
 		if (strcmp (name, "static") == 0)
 			slide->fixed = TRUE;
 
-		g_queue_push_tail (parser->slides, slide);
+		g_ptr_array_add (parser->slides, slide);
 	}
 	else if (strcmp (name, "size") == 0) {
-		Slide *slide = parser->slides->tail->data;
+		Slide *slide = g_ptr_array_index (parser->slides, parser->slides->len - 1);
 		FileSize *size = g_new0 (FileSize, 1);
 		for (i = 0; attr_names[i]; i++) {
 			if (strcmp (attr_names[i], "width") == 0)
@@ -2850,7 +6209,8 @@ handle_text (GMarkupParseContext *context,
 	g_return_if_fail (parser != NULL);
 	g_return_if_fail (parser->slides != NULL);
 
-	Slide *slide = parser->slides->tail ? parser->slides->tail->data : NULL;
+	Slide *slide = parser->slides->len > 0 ?
+		g_ptr_array_index (parser->slides, parser->slides->len - 1) : NULL;
 
 	if (stack_is (parser, "year", "starttime", "background", NULL)) {
 		parser->start_tm.tm_year = parse_int (text) - 1900;
@@ -2934,34 +6294,35 @@ handle_text (GMarkupParseContext *context,
 static SlideShow *
 slideshow_ref (SlideShow *show)
 {
-	show->ref_count++;
+	g_atomic_int_inc (&show->ref_count);
 	return show;
 }
 
 static void
 slideshow_unref (SlideShow *show)
 {
-	GList *list;
 	GSList *slist;
 	FileSize *size;
+	guint i;
 
-	show->ref_count--;
-	if (show->ref_count > 0)
+	if (!g_atomic_int_dec_and_test (&show->ref_count))
 		return;
 
-	for (list = show->slides->head; list != NULL; list = list->next) {
-		Slide *slide = list->data;
+	for (i = 0; i < show->slides->len; i++) {
+		Slide *slide = g_ptr_array_index (show->slides, i);
 
 		for (slist = slide->file1; slist != NULL; slist = slist->next) {
 			size = slist->data;
-			g_free (size->file);
+			if (!show->mapping)
+				g_free (size->file);
 			g_free (size);
 		}
 		g_slist_free (slide->file1);
 
 		for (slist = slide->file2; slist != NULL; slist = slist->next) {
 			size = slist->data;
-			g_free (size->file);
+			if (!show->mapping)
+				g_free (size->file);
 			g_free (size);
 		}
 		g_slist_free (slide->file2);
@@ -2969,21 +6330,46 @@ slideshow_unref (SlideShow *show)
 		g_free (slide);
 	}
 
-	g_queue_free (show->slides);
+	g_ptr_array_free (show->slides, TRUE);
 	g_queue_free_full (show->stack, g_free);
+	g_free (show->offsets);
+	if (show->mapping)
+		g_mapped_file_unref (show->mapping);
 	g_free (show);
 }
 
+/* Rough estimate of the memory used by a parsed slideshow, used to
+ * account for it in the file cache budget */
+static gsize
+slideshow_get_size (SlideShow *show)
+{
+	gsize size;
+	guint i;
+
+	size = sizeof (SlideShow);
+	size += show->slides->len * (sizeof (Slide *) + sizeof (double));
+
+	for (i = 0; i < show->slides->len; i++) {
+		Slide *slide = g_ptr_array_index (show->slides, i);
+
+		size += sizeof (Slide);
+		size += g_slist_length (slide->file1) * sizeof (FileSize);
+		size += g_slist_length (slide->file2) * sizeof (FileSize);
+	}
+
+	return size;
+}
+
 static void
 dump_bg (SlideShow *show)
 {
 #if 0
-	GList *list;
 	GSList *slist;
+	guint i;
 
-	for (list = show->slides->head; list != NULL; list = list->next)
+	for (i = 0; i < show->slides->len; i++)
 	{
-		Slide *slide = list->data;
+		Slide *slide = g_ptr_array_index (show->slides, i);
 
 		g_print ("\nSlide: %s\n", slide->fixed? "fixed" : "transition");
 		g_print ("duration: %f\n", slide->duration);
@@ -3020,6 +6406,387 @@ threadsafe_localtime (time_t time, struct tm *tm)
 	G_UNLOCK (localtime_mutex);
 }
 
+static void
+slideshow_build_index (SlideShow *show)
+{
+	double elapsed;
+	guint i;
+
+	show->offsets = g_new (double, show->slides->len + 1);
+
+	elapsed = 0;
+	for (i = 0; i < show->slides->len; i++) {
+		Slide *slide = g_ptr_array_index (show->slides, i);
+
+		if (slide->fixed) {
+			slide->step = slide->duration;
+		} else {
+			/* Maybe the number of steps should be configurable? */
+
+			/* In the worst case we will do a fade from 0 to 256, which mean
+			 * we will never use more than 255 steps, however in most cases
+			 * the first and last value are similar and users can't percieve
+			 * changes in pixel values as small as 1/255th. So, lets not waste
+			 * CPU cycles on transitioning to often.
+			 *
+			 * 64 steps is enough for each step to be just detectable in a 16bit
+			 * color mode in the worst case, so we'll use this as an approximation
+			 * of whats detectable.
+			 */
+			slide->step = slide->duration / 64.0;
+		}
+
+		show->offsets[i] = elapsed;
+		elapsed += slide->duration;
+	}
+	show->offsets[i] = elapsed;
+	show->total_duration = elapsed;
+}
+
+/*
+ * Compiled slideshows
+ *
+ * Parsing the XML of generated slideshows with thousands of slides takes
+ * a while, so the parsed result is also written to the cache directory,
+ * in a flat form which is mapped when loaded again: the file names are
+ * used in place. The compiled file is only used while the modification
+ * time and size of the XML file are the same as when it was written.
+ */
+#define SLIDESHOW_CACHE_DIR     "slideshows"
+#define SLIDESHOW_CACHE_MAGIC   0x5342474d /* "MGBS" */
+#define SLIDESHOW_CACHE_VERSION 1
+#define SLIDESHOW_CACHE_NO_FILE G_MAXUINT32
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	gint64  mtime;
+	gint64  size;
+	double  total_duration;
+	/* year, month, day, hour, minute, second, isdst */
+	gint32  start_tm[7];
+	guint32 has_multiple_sizes;
+	guint32 n_slides;
+	guint32 n_sizes;
+	guint32 strings_length;
+} CompiledHeader;
+
+typedef struct {
+	double  duration;
+	guint32 fixed;
+	guint32 first_size; /* file1 sizes, then file2 sizes */
+	guint32 n_file1;
+	guint32 n_file2;
+} CompiledSlide;
+
+typedef struct {
+	gint32  width;
+	gint32  height;
+	guint32 file; /* offset in the strings, or SLIDESHOW_CACHE_NO_FILE */
+} CompiledSize;
+
+static char *
+slideshow_cache_path (const char *filename)
+{
+	gchar *cache_dir;
+	gchar *hash;
+	gchar *name;
+	gchar *path;
+
+	cache_dir = get_wallpaper_cache_dir ();
+	hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, filename, -1);
+	name = g_strdup_printf ("%s.bin", hash);
+	path = g_build_filename (cache_dir, SLIDESHOW_CACHE_DIR, name, NULL);
+
+	g_free (name);
+	g_free (hash);
+	g_free (cache_dir);
+
+	return path;
+}
+
+static guint32
+compiled_add_string (GByteArray  *strings,
+		     GHashTable  *offsets,
+		     const char  *string)
+{
+	gpointer offset;
+
+	if (string == NULL)
+		return SLIDESHOW_CACHE_NO_FILE;
+
+	/* transitions name the same files as the slides around them */
+	if (g_hash_table_lookup_extended (offsets, string, NULL, &offset))
+		return GPOINTER_TO_UINT (offset);
+
+	offset = GUINT_TO_POINTER (strings->len);
+	g_byte_array_append (strings, (const guint8 *) string, strlen (string) + 1);
+	g_hash_table_insert (offsets, (gpointer) string, offset);
+
+	return GPOINTER_TO_UINT (offset);
+}
+
+static void
+compiled_add_sizes (GArray     *sizes,
+		    GByteArray *strings,
+		    GHashTable *offsets,
+		    GSList     *list)
+{
+	for (; list != NULL; list = list->next) {
+		FileSize *fs = list->data;
+		CompiledSize size;
+
+		size.width = fs->width;
+		size.height = fs->height;
+		size.file = compiled_add_string (strings, offsets, fs->file);
+		g_array_append_val (sizes, size);
+	}
+}
+
+typedef struct {
+	char   *path;
+	GBytes *data;
+} CompiledStore;
+
+static void
+compiled_store_free (CompiledStore *store)
+{
+	g_free (store->path);
+	g_bytes_unref (store->data);
+	g_free (store);
+}
+
+static void
+slideshow_write_compiled_thread (GTask        *task,
+				 gpointer      source_object,
+				 gpointer      task_data,
+				 GCancellable *cancellable)
+{
+	CompiledStore *store = task_data;
+	gboolean written = FALSE;
+	gchar *dir;
+
+	dir = g_path_get_dirname (store->path);
+	if (g_mkdir_with_parents (dir, 0700) == 0)
+		written = g_file_set_contents (store->path,
+					       g_bytes_get_data (store->data, NULL),
+					       g_bytes_get_size (store->data), NULL);
+	g_free (dir);
+
+	g_task_return_boolean (task, written);
+}
+
+/* Flattening is quick, writing the file happens in the background */
+static void
+slideshow_write_compiled (SlideShow      *show,
+			  const char     *filename,
+			  const GStatBuf *st)
+{
+	CompiledHeader header;
+	GByteArray *data;
+	GByteArray *strings;
+	GArray *slides;
+	GArray *sizes;
+	GHashTable *offsets;
+	CompiledStore *store;
+	GTask *task;
+	guint i;
+
+	slides = g_array_sized_new (FALSE, FALSE, sizeof (CompiledSlide), show->slides->len);
+	sizes = g_array_new (FALSE, FALSE, sizeof (CompiledSize));
+	strings = g_byte_array_new ();
+	offsets = g_hash_table_new (g_str_hash, g_str_equal);
+
+	for (i = 0; i < show->slides->len; i++) {
+		Slide *slide = g_ptr_array_index (show->slides, i);
+		CompiledSlide compiled;
+
+		compiled.duration = slide->duration;
+		compiled.fixed = slide->fixed;
+		compiled.first_size = sizes->len;
+		compiled.n_file1 = g_slist_length (slide->file1);
+		compiled.n_file2 = g_slist_length (slide->file2);
+		g_array_append_val (slides, compiled);
+
+		compiled_add_sizes (sizes, strings, offsets, slide->file1);
+		compiled_add_sizes (sizes, strings, offsets, slide->file2);
+	}
+
+	memset (&header, 0, sizeof (header));
+	header.magic = SLIDESHOW_CACHE_MAGIC;
+	header.version = SLIDESHOW_CACHE_VERSION;
+	header.mtime = st->st_mtime;
+	header.size = st->st_size;
+	header.total_duration = show->total_duration;
+	header.start_tm[0] = show->start_tm.tm_year;
+	header.start_tm[1] = show->start_tm.tm_mon;
+	header.start_tm[2] = show->start_tm.tm_mday;
+	header.start_tm[3] = show->start_tm.tm_hour;
+	header.start_tm[4] = show->start_tm.tm_min;
+	header.start_tm[5] = show->start_tm.tm_sec;
+	header.start_tm[6] = show->start_tm.tm_isdst;
+	header.has_multiple_sizes = show->has_multiple_sizes;
+	header.n_slides = slides->len;
+	header.n_sizes = sizes->len;
+	header.strings_length = strings->len;
+
+	data = g_byte_array_new ();
+	g_byte_array_append (data, (const guint8 *) &header, sizeof (header));
+	g_byte_array_append (data, (const guint8 *) slides->data,
+			     slides->len * sizeof (CompiledSlide));
+	g_byte_array_append (data, (const guint8 *) sizes->data,
+			     sizes->len * sizeof (CompiledSize));
+	g_byte_array_append (data, strings->data, strings->len);
+
+	store = g_new0 (CompiledStore, 1);
+	store->path = slideshow_cache_path (filename);
+	store->data = g_byte_array_free_to_bytes (data);
+
+	task = g_task_new (NULL, NULL, NULL, NULL);
+	g_task_set_source_tag (task, slideshow_write_compiled);
+	g_task_set_task_data (task, store, (GDestroyNotify) compiled_store_free);
+	g_task_run_in_thread (task, slideshow_write_compiled_thread);
+	g_object_unref (task);
+
+	g_hash_table_destroy (offsets);
+	g_byte_array_unref (strings);
+	g_array_unref (sizes);
+	g_array_unref (slides);
+}
+
+static GSList *
+compiled_get_sizes (const CompiledSize *sizes,
+		    guint               n_sizes,
+		    const char         *strings)
+{
+	GSList *list = NULL;
+	guint i;
+
+	/* same order as written */
+	for (i = n_sizes; i > 0; i--) {
+		const CompiledSize *size = &sizes[i - 1];
+		FileSize *fs = g_new (FileSize, 1);
+
+		fs->width = size->width;
+		fs->height = size->height;
+		fs->file = size->file == SLIDESHOW_CACHE_NO_FILE ?
+			NULL : (char *) strings + size->file;
+		list = g_slist_prepend (list, fs);
+	}
+
+	return list;
+}
+
+static SlideShow *
+slideshow_read_compiled (const char     *filename,
+			 const GStatBuf *st)
+{
+	const CompiledHeader *header;
+	const CompiledSlide *slides;
+	const CompiledSize *sizes;
+	const char *strings;
+	GMappedFile *mapping;
+	SlideShow *show;
+	const char *contents;
+	gsize length;
+	gchar *path;
+	guint i;
+
+	path = slideshow_cache_path (filename);
+	mapping = g_mapped_file_new (path, FALSE, NULL);
+	g_free (path);
+
+	if (mapping == NULL)
+		return NULL;
+
+	contents = g_mapped_file_get_contents (mapping);
+	length = g_mapped_file_get_length (mapping);
+	header = (const CompiledHeader *) contents;
+
+	if (length < sizeof (CompiledHeader) ||
+	    header->magic != SLIDESHOW_CACHE_MAGIC ||
+	    header->version != SLIDESHOW_CACHE_VERSION ||
+	    header->mtime != (gint64) st->st_mtime ||
+	    header->size != (gint64) st->st_size ||
+	    header->n_slides == 0 ||
+	    header->n_slides > length / sizeof (CompiledSlide) ||
+	    header->n_sizes > length / sizeof (CompiledSize) ||
+	    length != sizeof (CompiledHeader) +
+		      header->n_slides * sizeof (CompiledSlide) +
+		      header->n_sizes * sizeof (CompiledSize) +
+		      header->strings_length ||
+	    (header->strings_length > 0 && contents[length - 1] != '\0')) {
+		g_mapped_file_unref (mapping);
+		return NULL;
+	}
+
+	slides = (const CompiledSlide *) (header + 1);
+	sizes = (const CompiledSize *) (slides + header->n_slides);
+	strings = (const char *) (sizes + header->n_sizes);
+
+	for (i = 0; i < header->n_sizes; i++) {
+		if (sizes[i].file != SLIDESHOW_CACHE_NO_FILE &&
+		    sizes[i].file >= header->strings_length) {
+			g_mapped_file_unref (mapping);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < header->n_slides; i++) {
+		const CompiledSlide *slide = &slides[i];
+
+		if (slide->first_size > header->n_sizes ||
+		    slide->n_file1 > header->n_sizes - slide->first_size ||
+		    slide->n_file2 > header->n_sizes - slide->first_size - slide->n_file1 ||
+		    !(slide->duration >= 0) || !isfinite (slide->duration)) {
+			g_mapped_file_unref (mapping);
+			return NULL;
+		}
+	}
+
+	show = g_new0 (SlideShow, 1);
+	show->ref_count = 1;
+	show->mapping = mapping;
+	show->stack = g_queue_new ();
+	show->slides = g_ptr_array_sized_new (header->n_slides);
+	show->has_multiple_sizes = header->has_multiple_sizes;
+
+	threadsafe_localtime ((time_t)0, &show->start_tm);
+	show->start_tm.tm_year = header->start_tm[0];
+	show->start_tm.tm_mon = header->start_tm[1];
+	show->start_tm.tm_mday = header->start_tm[2];
+	show->start_tm.tm_hour = header->start_tm[3];
+	show->start_tm.tm_min = header->start_tm[4];
+	show->start_tm.tm_sec = header->start_tm[5];
+	show->start_tm.tm_isdst = header->start_tm[6];
+	show->start_time = (double) mktime (&show->start_tm);
+
+	for (i = 0; i < header->n_slides; i++) {
+		const CompiledSlide *compiled = &slides[i];
+		Slide *slide = g_new0 (Slide, 1);
+
+		slide->duration = compiled->duration;
+		slide->fixed = compiled->fixed;
+		slide->file1 = compiled_get_sizes (sizes + compiled->first_size,
+						   compiled->n_file1, strings);
+		slide->file2 = compiled_get_sizes (sizes + compiled->first_size + compiled->n_file1,
+						   compiled->n_file2, strings);
+		g_ptr_array_add (show->slides, slide);
+	}
+
+	slideshow_build_index (show);
+
+	/* get_slide_state() needs a total the offsets add up to, which is
+	 * what was written */
+	if (show->total_duration != header->total_duration ||
+	    !(show->total_duration > 0)) {
+		slideshow_unref (show);
+		return NULL;
+	}
+
+	return show;
+}
+
 static SlideShow *
 read_slideshow_file (const char *filename,
 		     GError     **err)
@@ -3038,10 +6805,19 @@ read_slideshow_file (const char *filename,
 	SlideShow *show = NULL;
 	GMarkupParseContext *context = NULL;
 	time_t t;
+	GStatBuf st;
+	gboolean have_stat;
 
 	if (!filename)
 		return NULL;
 
+	have_stat = g_stat (filename, &st) == 0;
+	if (have_stat) {
+		show = slideshow_read_compiled (filename, &st);
+		if (show)
+			return show;
+	}
+
 	file = g_file_new_for_path (filename);
 	if (!g_file_load_contents (file, NULL, &contents, &len, NULL, NULL)) {
 		g_object_unref (file);
@@ -3053,7 +6829,7 @@ read_slideshow_file (const char *filename,
 	show->ref_count = 1;
 	threadsafe_localtime ((time_t)0, &show->start_tm);
 	show->stack = g_queue_new ();
-	show->slides = g_queue_new ();
+	show->slides = g_ptr_array_new ();
 
 	context = g_markup_parse_context_new (&parser, 0, show, NULL);
 
@@ -3080,7 +6856,7 @@ read_slideshow_file (const char *filename,
 
 		dump_bg (show);
 
-		num_items = g_queue_get_length (show->slides);
+		num_items = show->slides->len;
 
 		/* no slides, that's not a slideshow */
 		if (num_items == 0) {
@@ -3088,11 +6864,18 @@ read_slideshow_file (const char *filename,
 			show = NULL;
 		/* one slide, there's no transition */
 		} else if (num_items == 1) {
-			Slide *slide = show->slides->head->data;
+			Slide *slide = g_ptr_array_index (show->slides, 0);
 			slide->duration = show->total_duration = G_MAXUINT;
 		}
 	}
 
+	if (show) {
+		slideshow_build_index (show);
+
+		if (have_stat)
+			slideshow_write_compiled (show, filename, &st);
+	}
+
 	g_free (contents);
 
 	return show;
@@ -3198,7 +6981,7 @@ mate_bg_changes_with_time (MateBG *bg)
 	if ((show = get_as_slideshow (bg, bg->filename)) != NULL) {
 		gboolean result;
 
-		result = (g_queue_get_length (show->slides) > 1) ? TRUE : FALSE;
+		result = (show->slides->len > 1) ? TRUE : FALSE;
 		slideshow_unref (show);
 		return result;
 	}
@@ -3227,7 +7010,7 @@ mate_bg_create_frame_thumbnail (MateBG			*bg,
 	SlideShow *show;
 	GdkPixbuf *result;
 	GdkPixbuf *thumb;
-        GList *l;
+        guint n;
         int i, skipped;
         gboolean found;
 
@@ -3238,14 +7021,14 @@ mate_bg_create_frame_thumbnail (MateBG			*bg,
 	if (!show)
 		return NULL;
 
-	if (frame_num < 0 || (guint) frame_num >= g_queue_get_length (show->slides))
+	if (frame_num < 0 || (guint) frame_num >= show->slides->len)
 		return NULL;
 
 	i = 0;
 	skipped = 0;
 	found = FALSE;
-	for (l = show->slides->head; l; l = l->next) {
-		Slide *slide = l->data;
+	for (n = 0; n < show->slides->len; n++) {
+		Slide *slide = g_ptr_array_index (show->slides, n);
 		if (!slide->fixed) {
 			skipped++;
 			continue;
@@ -64,6 +64,8 @@ G_BEGIN_DECLS
 #define MATE_BG_KEY_PICTURE_PLACEMENT	"picture-options"
 #define MATE_BG_KEY_PICTURE_OPACITY	"picture-opacity"
 #define MATE_BG_KEY_PICTURE_FILENAME	"picture-filename"
+#define MATE_BG_KEY_CACHE_MAXIMUM_SIZE	"cache-maximum-size"
+#define MATE_BG_KEY_CACHE_FORMAT	"cache-format"
 
 typedef struct _MateBG MateBG;
 typedef struct _MateBGClass MateBGClass;
@@ -116,6 +118,20 @@ void		 mate_bg_get_color             (MateBG               *bg,
 						 GdkRGBA              *secondary);
 const gchar *    mate_bg_get_filename          (MateBG               *bg);
 
+/* Cache tuning */
+void             mate_bg_set_cache_budget      (MateBG               *bg,
+						gsize                 budget);
+gsize            mate_bg_get_cache_budget      (MateBG               *bg);
+void             mate_bg_get_cache_stats       (MateBG               *bg,
+						guint                *hits,
+						guint                *misses,
+						guint                *evictions);
+
+/* Rendering */
+void             mate_bg_set_max_render_threads (MateBG              *bg,
+						 guint                max_threads);
+guint            mate_bg_get_max_render_threads (MateBG              *bg);
+
 /* Drawing and thumbnailing */
 void             mate_bg_draw                  (MateBG               *bg,
 						 GdkPixbuf             *dest,
@@ -135,6 +151,20 @@ cairo_surface_t *mate_bg_create_surface_scale  (MateBG               *bg,
 						int                   scale,
 						gboolean              root);
 
+void             mate_bg_create_surface_async  (MateBG               *bg,
+						GdkWindow            *window,
+						int                   width,
+						int                   height,
+						int                   scale,
+						gboolean              root,
+						GCancellable         *cancellable,
+						GAsyncReadyCallback   callback,
+						gpointer              user_data);
+
+cairo_surface_t *mate_bg_create_surface_finish (MateBG               *bg,
+						GAsyncResult         *result,
+						GError              **error);
+
 gboolean         mate_bg_get_image_size        (MateBG               *bg,
 						 MateDesktopThumbnailFactory *factory,
                                                  int                    best_width,
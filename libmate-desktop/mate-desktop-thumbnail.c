@@ -24,13 +24,20 @@
  * Author: Alexander Larsson <alexl@redhat.com>
  */
 
+#define _GNU_SOURCE /* memfd_create() */
+
 #include <config.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 
 #define MATE_DESKTOP_USE_UNSTABLE_API
 #include "mate-desktop-thumbnail.h"
@@ -55,6 +62,11 @@ struct _MateDesktopThumbnailFactoryPrivate {
   gboolean loaded : 1;
   gboolean disabled : 1;
   gchar **disabled_types;
+
+  /* asynchronous generation, see generate_thumbnail_async() */
+  GMutex queue_lock;
+  GThreadPool *generate_pool;
+  GHashTable *generate_requests;
 };
 
 static const char *appname = "mate-thumbnail-factory";
@@ -67,6 +79,22 @@ G_DEFINE_TYPE_WITH_PRIVATE (MateDesktopThumbnailFactory,
 
 #define THUMBNAILER_ENTRY_GROUP "Thumbnailer Entry"
 #define THUMBNAILER_EXTENSION   ".thumbnailer"
+#define THUMBNAILER_OUTPUT_FD_KEY "X-MATE-OutputFd"
+
+#define PNG_SIGNATURE           "\211PNG\r\n\032\n"
+/* Larger tEXt chunks are not thumbnail metadata */
+#define PNG_TEXT_CHUNK_MAX      4096
+/* other chunks are skipped in steps a 32-bit long can hold */
+#define PNG_SKIP_STEP           (1 << 30)
+
+/* Batched lookups list the thumbnail directory when they are at least
+ * this large, and validate in parallel from this many files on */
+#define LOOKUP_SCAN_MIN_FILES     64
+#define LOOKUP_PARALLEL_MIN_FILES 16
+
+/* Embedded jpeg thumbnails are used when their aspect ratio is within
+ * this of the image's, i.e. they are not letterboxed */
+#define EXIF_THUMBNAIL_ASPECT_SLACK 0.05
 
 typedef struct {
     volatile gint ref_count;
@@ -74,6 +102,7 @@ typedef struct {
     gchar  *try_exec;
     gchar  *command;
     gchar **mime_types;
+    gboolean output_fd;
 } Thumbnailer;
 
 static Thumbnailer *
@@ -150,6 +179,11 @@ thumbnailer_load (Thumbnailer *thumb)
 
   thumb->try_exec = g_key_file_get_string (key_file, THUMBNAILER_ENTRY_GROUP, "TryExec", NULL);
 
+  /* whether %o can be a /proc/self/fd path, i.e. the thumbnailer opens it
+   * for writing itself, and does not rename a file over it */
+  thumb->output_fd = g_key_file_get_boolean (key_file, THUMBNAILER_ENTRY_GROUP,
+                                             THUMBNAILER_OUTPUT_FD_KEY, NULL);
+
   g_key_file_free (key_file);
 
   return thumb;
@@ -166,6 +200,7 @@ thumbnailer_reload (Thumbnailer *thumb)
   thumb->mime_types = NULL;
   g_free (thumb->try_exec);
   thumb->try_exec = NULL;
+  thumb->output_fd = FALSE;
 
   return thumbnailer_load (thumb);
 }
@@ -561,6 +596,9 @@ mate_desktop_thumbnail_factory_init (MateDesktopThumbnailFactory *factory)
                                                 (GDestroyNotify)thumbnailer_unref);
 
   g_mutex_init (&priv->lock);
+  g_mutex_init (&priv->queue_lock);
+
+  priv->generate_requests = g_hash_table_new (g_str_hash, g_str_equal);
 
   priv->settings = g_settings_new ("org.mate.thumbnailers");
 
@@ -604,7 +642,17 @@ mate_desktop_thumbnail_factory_finalize (GObject *object)
       priv->monitors = NULL;
     }
 
+  /* requests hold a reference on the factory, so none are left; don't
+   * wait for the threads, this may be the last of them */
+  if (priv->generate_pool)
+    {
+      g_thread_pool_free (priv->generate_pool, FALSE, FALSE);
+      priv->generate_pool = NULL;
+    }
+  g_clear_pointer (&priv->generate_requests, g_hash_table_destroy);
+
   g_mutex_clear (&priv->lock);
+  g_mutex_clear (&priv->queue_lock);
 
   g_clear_pointer (&priv->disabled_types, g_strfreev);
 
@@ -678,19 +726,26 @@ thumbnail_filename (const char *uri)
   return file;
 }
 
+static char *
+thumbnail_dir (MateDesktopThumbnailSize size)
+{
+  return g_build_filename (g_get_user_cache_dir (),
+                           "thumbnails",
+                           size == MATE_DESKTOP_THUMBNAIL_SIZE_LARGE ? "large" : "normal",
+                           NULL);
+}
+
 static char *
 thumbnail_path (const char               *uri,
                 MateDesktopThumbnailSize  size)
 {
-  char *path, *file;
+  char *path, *dir, *file;
 
+  dir = thumbnail_dir (size);
   file = thumbnail_filename (uri);
-  path = g_build_filename (g_get_user_cache_dir (),
-                           "thumbnails",
-                           size == MATE_DESKTOP_THUMBNAIL_SIZE_LARGE ? "large" : "normal",
-                           file,
-                           NULL);
+  path = g_build_filename (dir, file, NULL);
   g_free (file);
+  g_free (dir);
   return path;
 }
 
@@ -711,22 +766,158 @@ thumbnail_failed_path (const char *uri)
   return path;
 }
 
+static gboolean
+thumbnail_text_is_valid (const char *thumb_uri,
+                         const char *thumb_mtime_str,
+                         const char *uri,
+                         time_t      mtime)
+{
+  time_t thumb_mtime;
+
+  if (g_strcmp0 (uri, thumb_uri) != 0)
+    return FALSE;
+
+  if (!thumb_mtime_str)
+    return FALSE;
+  thumb_mtime = (time_t)g_ascii_strtoll (thumb_mtime_str, (gchar**)NULL, 10);
+  if (mtime != thumb_mtime)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Reads the Thumb::URI and Thumb::MTime tEXt chunks of the png at @path,
+ * stopping before the image data, so that none of it is read or inflated.
+ * Returns FALSE if @path is not a readable png.
+ */
+static gboolean
+read_thumbnail_text (const char  *path,
+                     char       **thumb_uri,
+                     char       **thumb_mtime)
+{
+  FILE *file;
+  guchar header[8];
+  gboolean result = FALSE;
+
+  *thumb_uri = NULL;
+  *thumb_mtime = NULL;
+
+  file = g_fopen (path, "rb");
+  if (file == NULL)
+    return FALSE;
+
+  if (fread (header, 1, sizeof (header), file) != sizeof (header) ||
+      memcmp (header, PNG_SIGNATURE, sizeof (header)) != 0)
+    goto out;
+
+  while (*thumb_uri == NULL || *thumb_mtime == NULL)
+    {
+      guint32 length;
+      char *data;
+      char **value;
+      gsize keyword_length;
+
+      /* chunk length and type */
+      if (fread (header, 1, sizeof (header), file) != sizeof (header))
+        goto out;
+
+      memcpy (&length, header, sizeof (length));
+      length = GUINT32_FROM_BE (length);
+      if (length > G_MAXINT32)
+        goto out;
+
+      if (memcmp (header + 4, "IDAT", 4) == 0 ||
+          memcmp (header + 4, "IEND", 4) == 0)
+        break;
+
+      /* skip the data and crc of anything else */
+      if (memcmp (header + 4, "tEXt", 4) != 0 || length > PNG_TEXT_CHUNK_MAX)
+        {
+          guint64 skip = (guint64) length + 4;
+
+          while (skip > 0)
+            {
+              long step = (long) MIN (skip, PNG_SKIP_STEP);
+
+              if (fseek (file, step, SEEK_CUR) != 0)
+                goto out;
+              skip -= step;
+            }
+          continue;
+        }
+
+      data = g_malloc (length + 1);
+      if (fread (data, 1, length, file) != length ||
+          fseek (file, 4, SEEK_CUR) != 0)
+        {
+          g_free (data);
+          goto out;
+        }
+      data[length] = '\0';
+
+      keyword_length = strlen (data);
+      if (strcmp (data, "Thumb::URI") == 0)
+        value = thumb_uri;
+      else if (strcmp (data, "Thumb::MTime") == 0)
+        value = thumb_mtime;
+      else
+        value = NULL;
+
+      /* tEXt values are latin-1; like gdk-pixbuf, return them as utf-8 */
+      if (value != NULL && *value == NULL && keyword_length < length)
+        *value = g_convert (data + keyword_length + 1, -1,
+                            "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+
+      g_free (data);
+    }
+
+  result = TRUE;
+
+out:
+  if (!result)
+    {
+      g_clear_pointer (thumb_uri, g_free);
+      g_clear_pointer (thumb_mtime, g_free);
+    }
+
+  fclose (file);
+
+  return result;
+}
+
 static char *
 validate_thumbnail_path (char                     *path,
                          const char               *uri,
                          time_t                    mtime,
                          MateDesktopThumbnailSize  size)
 {
-  GdkPixbuf *pixbuf;
+  char *thumb_uri, *thumb_mtime;
+  gboolean valid;
 
-  pixbuf = gdk_pixbuf_new_from_file (path, NULL);
-  if (pixbuf == NULL ||
-      !mate_desktop_thumbnail_is_valid (pixbuf, uri, mtime)) {
+  if (!read_thumbnail_text (path, &thumb_uri, &thumb_mtime)) {
       g_free (path);
       return NULL;
   }
 
-  g_clear_object (&pixbuf);
+  if (thumb_uri != NULL && thumb_mtime != NULL) {
+      valid = thumbnail_text_is_valid (thumb_uri, thumb_mtime, uri, mtime);
+  } else {
+      GdkPixbuf *pixbuf;
+
+      /* the text may also come after the image data */
+      pixbuf = gdk_pixbuf_new_from_file (path, NULL);
+      valid = pixbuf != NULL &&
+              mate_desktop_thumbnail_is_valid (pixbuf, uri, mtime);
+      g_clear_object (&pixbuf);
+  }
+
+  g_free (thumb_uri);
+  g_free (thumb_mtime);
+
+  if (!valid) {
+      g_free (path);
+      return NULL;
+  }
 
   return path;
 }
@@ -775,6 +966,182 @@ mate_desktop_thumbnail_factory_lookup (MateDesktopThumbnailFactory *factory,
   return lookup_thumbnail_path (uri, mtime, priv->size);
 }
 
+typedef struct {
+  const char * const       *uris;
+  const time_t             *mtimes;
+  MateDesktopThumbnailSize  size;
+  char                    **paths; /* candidates, then valid thumbnails */
+  gint                      n_files;
+  gint                      next_file;
+  gint                      n_workers;
+  GMutex                    lock;
+  GCond                     done;
+} LookupBatch;
+
+G_LOCK_DEFINE_STATIC (lookup_pool);
+static GThreadPool *lookup_pool = NULL;
+
+static void
+lookup_batch_run (LookupBatch *batch)
+{
+  gint i;
+
+  while ((i = g_atomic_int_add (&batch->next_file, 1)) < batch->n_files)
+    {
+      if (batch->paths[i] != NULL)
+        batch->paths[i] = validate_thumbnail_path (batch->paths[i],
+                                                   batch->uris[i],
+                                                   batch->mtimes[i],
+                                                   batch->size);
+    }
+}
+
+static void
+lookup_pool_worker (gpointer data,
+                    gpointer user_data)
+{
+  LookupBatch *batch = data;
+
+  lookup_batch_run (batch);
+
+  g_mutex_lock (&batch->lock);
+  if (--batch->n_workers == 0)
+    g_cond_signal (&batch->done);
+  g_mutex_unlock (&batch->lock);
+}
+
+/* Names of the files in @dir, so that thumbnails which do not exist need
+ * not be looked for one by one */
+static GHashTable *
+list_thumbnail_dir (const char *dir)
+{
+  GHashTable *names;
+  const char *name;
+  GDir *gdir;
+
+  names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  gdir = g_dir_open (dir, 0, NULL);
+  if (gdir == NULL)
+    return names;
+
+  while ((name = g_dir_read_name (gdir)) != NULL)
+    g_hash_table_add (names, g_strdup (name));
+
+  g_dir_close (gdir);
+
+  return names;
+}
+
+/**
+ * mate_desktop_thumbnail_factory_lookup_many:
+ * @factory: a #MateDesktopThumbnailFactory
+ * @uris: (array length=n_files): the uris of the files
+ * @mtimes: (array length=n_files): the mtimes of the files
+ * @n_files: the number of files
+ *
+ * Tries to locate existing thumbnails for several files at once, as
+ * mate_desktop_thumbnail_factory_lookup() does for one. For large
+ * batches the thumbnail directory is listed once instead of looking
+ * for each thumbnail, and the thumbnails found are validated in
+ * parallel.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Return value: (array length=n_files) (transfer full): for each file,
+ * the absolute path of its thumbnail, or %NULL if none exist. Free the
+ * paths and the array with g_free().
+ *
+ * Since: 1.29
+ **/
+char **
+mate_desktop_thumbnail_factory_lookup_many (MateDesktopThumbnailFactory *factory,
+                                            const char * const          *uris,
+                                            const time_t                *mtimes,
+                                            guint                        n_files)
+{
+  LookupBatch batch;
+  GHashTable *names = NULL;
+  char **paths;
+  char *dir;
+  guint n_threads;
+  guint i;
+
+  g_return_val_if_fail (MATE_DESKTOP_IS_THUMBNAIL_FACTORY (factory), NULL);
+  g_return_val_if_fail (n_files == 0 || uris != NULL, NULL);
+  g_return_val_if_fail (n_files == 0 || mtimes != NULL, NULL);
+
+  paths = g_new0 (char *, MAX (n_files, 1));
+
+  dir = thumbnail_dir (factory->priv->size);
+
+  if (n_files >= LOOKUP_SCAN_MIN_FILES)
+    names = list_thumbnail_dir (dir);
+
+  for (i = 0; i < n_files; i++)
+    {
+      char *file;
+
+      if (uris[i] == NULL)
+        continue;
+
+      file = thumbnail_filename (uris[i]);
+      if (names == NULL || g_hash_table_contains (names, file))
+        paths[i] = g_build_filename (dir, file, NULL);
+      g_free (file);
+    }
+
+  if (names != NULL)
+    g_hash_table_destroy (names);
+  g_free (dir);
+
+  batch.uris = uris;
+  batch.mtimes = mtimes;
+  batch.size = factory->priv->size;
+  batch.paths = paths;
+  batch.n_files = n_files;
+  batch.next_file = 0;
+
+  if (n_files < LOOKUP_PARALLEL_MIN_FILES)
+    n_threads = 1;
+  else
+    n_threads = MIN (g_get_num_processors (), n_files / LOOKUP_PARALLEL_MIN_FILES);
+
+  if (n_threads <= 1)
+    {
+      lookup_batch_run (&batch);
+      return paths;
+    }
+
+  G_LOCK (lookup_pool);
+  if (lookup_pool == NULL)
+    lookup_pool = g_thread_pool_new (lookup_pool_worker, NULL,
+                                     g_get_num_processors (),
+                                     FALSE, NULL);
+  G_UNLOCK (lookup_pool);
+
+  batch.n_workers = n_threads - 1;
+  g_mutex_init (&batch.lock);
+  g_cond_init (&batch.done);
+
+  /* The workers and this thread take files until there are none left;
+   * then wait for the workers to be done with theirs */
+  for (i = 0; i < n_threads - 1; i++)
+    g_thread_pool_push (lookup_pool, &batch, NULL);
+
+  lookup_batch_run (&batch);
+
+  g_mutex_lock (&batch.lock);
+  while (batch.n_workers > 0)
+    g_cond_wait (&batch.done, &batch.lock);
+  g_mutex_unlock (&batch.lock);
+
+  g_mutex_clear (&batch.lock);
+  g_cond_clear (&batch.done);
+
+  return paths;
+}
+
 /**
  * mate_desktop_thumbnail_factory_has_valid_failed_thumbnail:
  * @factory: a #MateDesktopThumbnailFactory
@@ -1036,6 +1403,441 @@ get_preview_thumbnail (const char *uri,
     return pixbuf;
 }
 
+static guint
+exif_get_16 (const guchar *data,
+             gboolean      little_endian)
+{
+  if (little_endian)
+    return data[0] | (data[1] << 8);
+  return (data[0] << 8) | data[1];
+}
+
+static guint32
+exif_get_32 (const guchar *data,
+             gboolean      little_endian)
+{
+  if (little_endian)
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((guint32) data[3] << 24);
+  return ((guint32) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/* Offset of the IFD following the one at @offset, or 0 */
+static guint32
+exif_find_tags (const guchar *tiff,
+                gsize         length,
+                guint32       offset,
+                gboolean      little_endian,
+                const guint  *tags,
+                guint32      *values,
+                guint         n_tags)
+{
+  guint n_entries, i, j;
+
+  if (offset < 8 || offset > length - 2)
+    return 0;
+
+  n_entries = exif_get_16 (tiff + offset, little_endian);
+  if ((gsize) n_entries * 12 + 6 > length - offset)
+    return 0;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      const guchar *entry = tiff + offset + 2 + i * 12;
+      guint tag = exif_get_16 (entry, little_endian);
+      guint type = exif_get_16 (entry + 2, little_endian);
+
+      for (j = 0; j < n_tags; j++)
+        {
+          if (tag != tags[j])
+            continue;
+
+          /* SHORT values are left aligned in the value field */
+          if (type == 3)
+            values[j] = exif_get_16 (entry + 8, little_endian);
+          else
+            values[j] = exif_get_32 (entry + 8, little_endian);
+        }
+    }
+
+  return exif_get_32 (tiff + offset + 2 + n_entries * 12, little_endian);
+}
+
+/* The thumbnail cameras embed in the EXIF data of a jpeg, oriented as
+ * the image is; NULL if there is none */
+static GdkPixbuf *
+get_exif_thumbnail (const char *path)
+{
+  static const guint ifd0_tags[] = { 0x0112 };          /* Orientation */
+  static const guint ifd1_tags[] = { 0x0201, 0x0202 };  /* JPEGInterchangeFormat(Length) */
+  guint32 ifd0_values[] = { 0 };
+  guint32 ifd1_values[] = { 0, 0 };
+  GdkPixbuf *pixbuf = NULL;
+  guchar *segment = NULL;
+  guchar marker[4];
+  gsize length = 0;
+  FILE *file;
+
+  file = g_fopen (path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  if (fread (marker, 1, 2, file) != 2 || marker[0] != 0xff || marker[1] != 0xd8)
+    goto out;
+
+  /* the EXIF data is in an APP1 segment, before the image data */
+  for (;;)
+    {
+      guint segment_length;
+
+      if (fread (marker, 1, 4, file) != 4 || marker[0] != 0xff ||
+          marker[1] == 0xda || marker[1] == 0xd9)
+        goto out;
+
+      segment_length = (marker[2] << 8) | marker[3];
+      if (segment_length < 2)
+        goto out;
+      segment_length -= 2;
+
+      if (marker[1] != 0xe1)
+        {
+          if (fseek (file, segment_length, SEEK_CUR) != 0)
+            goto out;
+          continue;
+        }
+
+      segment = g_malloc (segment_length);
+      if (fread (segment, 1, segment_length, file) != segment_length)
+        goto out;
+
+      if (segment_length > 14 && memcmp (segment, "Exif\0\0", 6) == 0)
+        {
+          length = segment_length - 6;
+          break;
+        }
+
+      g_clear_pointer (&segment, g_free);
+    }
+
+  {
+    const guchar *tiff = segment + 6;
+    gboolean little_endian;
+    guint32 ifd1;
+
+    if (memcmp (tiff, "II", 2) == 0)
+      little_endian = TRUE;
+    else if (memcmp (tiff, "MM", 2) == 0)
+      little_endian = FALSE;
+    else
+      goto out;
+
+    ifd1 = exif_find_tags (tiff, length, exif_get_32 (tiff + 4, little_endian),
+                           little_endian, ifd0_tags, ifd0_values,
+                           G_N_ELEMENTS (ifd0_tags));
+    if (ifd1 == 0)
+      goto out;
+
+    exif_find_tags (tiff, length, ifd1, little_endian,
+                    ifd1_tags, ifd1_values, G_N_ELEMENTS (ifd1_tags));
+
+    if (ifd1_values[0] == 0 || ifd1_values[1] == 0 ||
+        ifd1_values[0] > length || ifd1_values[1] > length - ifd1_values[0])
+      goto out;
+
+    {
+      GdkPixbufLoader *loader;
+
+      loader = gdk_pixbuf_loader_new ();
+      if (gdk_pixbuf_loader_write (loader, tiff + ifd1_values[0], ifd1_values[1], NULL) &&
+          gdk_pixbuf_loader_close (loader, NULL))
+        pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+      else
+        gdk_pixbuf_loader_close (loader, NULL);
+
+      if (pixbuf != NULL)
+        g_object_ref (pixbuf);
+      g_object_unref (loader);
+    }
+
+    /* let gdk-pixbuf turn it around as it does the image */
+    if (pixbuf != NULL && ifd0_values[0] > 1 && ifd0_values[0] <= 8)
+      {
+        char *orientation = g_strdup_printf ("%u", ifd0_values[0]);
+        GdkPixbuf *oriented;
+
+        gdk_pixbuf_set_option (pixbuf, "orientation", orientation);
+        g_free (orientation);
+
+        oriented = gdk_pixbuf_apply_embedded_orientation (pixbuf);
+        g_object_unref (pixbuf);
+        pixbuf = oriented;
+      }
+  }
+
+out:
+  g_free (segment);
+  fclose (file);
+
+  return pixbuf;
+}
+
+static gboolean
+is_common_image_type (const char *mime_type)
+{
+  return strcmp (mime_type, "image/jpeg") == 0 ||
+         strcmp (mime_type, "image/png") == 0;
+}
+
+/* Thumbnails the most common images in process, as the external
+ * thumbnailer would, but without spawning it once per file */
+static GdkPixbuf *
+get_image_thumbnail (const char *uri,
+                     const char *mime_type,
+                     int         size)
+{
+  GdkPixbuf *pixbuf = NULL;
+  char *path;
+  int width, height;
+  char *value;
+
+  path = g_filename_from_uri (uri, NULL, NULL);
+  if (path == NULL)
+    return NULL;
+
+  if (gdk_pixbuf_get_file_info (path, &width, &height) == NULL)
+    {
+      g_free (path);
+      return NULL;
+    }
+
+  if (strcmp (mime_type, "image/jpeg") == 0 &&
+      (width > size || height > size))
+    {
+      pixbuf = get_exif_thumbnail (path);
+
+      /* the orientation may have swapped its sides */
+      if (pixbuf != NULL)
+        {
+          int thumb_width = gdk_pixbuf_get_width (pixbuf);
+          int thumb_height = gdk_pixbuf_get_height (pixbuf);
+          double aspect = (double) MAX (width, height) / MIN (width, height);
+          double thumb_aspect = (double) MAX (thumb_width, thumb_height) /
+                                MIN (thumb_width, thumb_height);
+
+          if (MAX (thumb_width, thumb_height) < size ||
+              ABS (aspect - thumb_aspect) > EXIF_THUMBNAIL_ASPECT_SLACK * aspect)
+            g_clear_object (&pixbuf);
+        }
+
+      if (pixbuf != NULL &&
+          (gdk_pixbuf_get_width (pixbuf) > size || gdk_pixbuf_get_height (pixbuf) > size))
+        {
+          GdkPixbuf *scaled;
+          double scale;
+
+          scale = (double) size / MAX (gdk_pixbuf_get_width (pixbuf),
+                                       gdk_pixbuf_get_height (pixbuf));
+          scaled = gdk_pixbuf_scale_simple (pixbuf,
+                                            MAX (1, (int) (gdk_pixbuf_get_width (pixbuf) * scale + 0.5)),
+                                            MAX (1, (int) (gdk_pixbuf_get_height (pixbuf) * scale + 0.5)),
+                                            GDK_INTERP_BILINEAR);
+          g_object_unref (pixbuf);
+          pixbuf = scaled;
+        }
+    }
+
+  if (pixbuf == NULL)
+    {
+      GdkPixbuf *loaded;
+
+      /* the loaders decode large images at a reduced size directly;
+       * smaller images are not blown up */
+      if (width > size || height > size)
+        loaded = gdk_pixbuf_new_from_file_at_scale (path, size, size, TRUE, NULL);
+      else
+        loaded = gdk_pixbuf_new_from_file (path, NULL);
+
+      if (loaded != NULL)
+        {
+          pixbuf = gdk_pixbuf_apply_embedded_orientation (loaded);
+          g_object_unref (loaded);
+        }
+    }
+
+  g_free (path);
+
+  if (pixbuf == NULL)
+    return NULL;
+
+  value = g_strdup_printf ("%d", width);
+  gdk_pixbuf_set_option (pixbuf, "tEXt::Thumb::Image::Width", value);
+  g_free (value);
+  value = g_strdup_printf ("%d", height);
+  gdk_pixbuf_set_option (pixbuf, "tEXt::Thumb::Image::Height", value);
+  g_free (value);
+
+  return pixbuf;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/* Runs a thumbnailer that declared it can write to a file descriptor
+ * with its output going to a memory file, handed to it as its fd 3,
+ * instead of to a temporary file on disk. Returns FALSE if that is not
+ * possible here; otherwise sets @output to what the thumbnailer wrote,
+ * or to NULL if it failed or wrote nothing.
+ */
+static gboolean
+run_thumbnailer_to_memory (const char  *script,
+                           int          size,
+                           const char  *uri,
+                           GBytes     **output)
+{
+  static gsize proc_checked = 0;
+  static gboolean have_proc = FALSE;
+  GSubprocessLauncher *launcher;
+  GSubprocess *subprocess;
+  char **expanded_script;
+  int fd, child_fd;
+
+  if (g_once_init_enter (&proc_checked))
+    {
+      have_proc = g_file_test ("/proc/self/fd", G_FILE_TEST_IS_DIR);
+      g_once_init_leave (&proc_checked, 1);
+    }
+
+  if (!have_proc)
+    return FALSE;
+
+  /* failures are reported when falling back to a temporary file */
+  expanded_script = expand_thumbnailing_script (script, size, uri, "/proc/self/fd/3", NULL);
+  if (expanded_script == NULL)
+    return FALSE;
+
+  fd = memfd_create ("mate-desktop-thumbnail", MFD_CLOEXEC);
+  if (fd == -1)
+    {
+      g_strfreev (expanded_script);
+      return FALSE;
+    }
+
+  child_fd = dup (fd);
+  if (child_fd == -1)
+    {
+      g_strfreev (expanded_script);
+      close (fd);
+      return FALSE;
+    }
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_take_fd (launcher, child_fd, 3);
+  subprocess = g_subprocess_launcher_spawnv (launcher,
+                                             (const gchar * const *) expanded_script,
+                                             NULL);
+  g_object_unref (launcher);
+  g_strfreev (expanded_script);
+
+  if (subprocess == NULL)
+    {
+      close (fd);
+      return FALSE;
+    }
+
+  *output = NULL;
+
+  if (g_subprocess_wait (subprocess, NULL, NULL) &&
+      g_subprocess_get_successful (subprocess))
+    {
+      GMappedFile *mapping;
+
+      /* the pages stay mapped once the memory file is closed */
+      mapping = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+      if (mapping != NULL)
+        {
+          if (g_mapped_file_get_length (mapping) > 0)
+            *output = g_mapped_file_get_bytes (mapping);
+          g_mapped_file_unref (mapping);
+        }
+    }
+
+  g_object_unref (subprocess);
+  close (fd);
+
+  return TRUE;
+}
+#else
+static gboolean
+run_thumbnailer_to_memory (const char  *script,
+                           int          size,
+                           const char  *uri,
+                           GBytes     **output)
+{
+  return FALSE;
+}
+#endif
+
+static GBytes *
+run_thumbnailer_to_file (const char *script,
+                         int         size,
+                         const char *uri)
+{
+  GBytes *output = NULL;
+  char **expanded_script;
+  GError *error = NULL;
+  int exit_status;
+  char *tmpname;
+  int fd;
+
+  fd = g_file_open_tmp (".mate_desktop_thumbnail.XXXXXX", &tmpname, NULL);
+  if (fd == -1)
+    return NULL;
+
+  close (fd);
+
+  expanded_script = expand_thumbnailing_script (script, size, uri, tmpname, &error);
+  if (expanded_script == NULL)
+    {
+      g_warning ("Failed to expand script '%s': %s", script, error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      gchar *contents;
+      gsize length;
+
+      if (g_spawn_sync (NULL, expanded_script, NULL, G_SPAWN_SEARCH_PATH,
+                        NULL, NULL, NULL, NULL, &exit_status, NULL) &&
+          exit_status == 0 &&
+          g_file_get_contents (tmpname, &contents, &length, NULL))
+        output = g_bytes_new_take (contents, length);
+
+      g_strfreev (expanded_script);
+    }
+
+  g_unlink (tmpname);
+  g_free (tmpname);
+
+  return output;
+}
+
+static GdkPixbuf *
+load_thumbnailer_output (GBytes *output)
+{
+  GdkPixbufLoader *loader;
+  GdkPixbuf *pixbuf = NULL;
+
+  loader = gdk_pixbuf_loader_new ();
+  if (gdk_pixbuf_loader_write_bytes (loader, output, NULL) &&
+      gdk_pixbuf_loader_close (loader, NULL))
+    pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  else
+    gdk_pixbuf_loader_close (loader, NULL);
+
+  if (pixbuf != NULL)
+    g_object_ref (pixbuf);
+  g_object_unref (loader);
+
+  return pixbuf;
+}
+
 /**
  * mate_desktop_thumbnail_factory_generate_thumbnail:
  * @factory: a #MateDesktopThumbnailFactory
@@ -1059,8 +1861,8 @@ mate_desktop_thumbnail_factory_generate_thumbnail (MateDesktopThumbnailFactory *
   GdkPixbuf *pixbuf;
   char *script;
   int size;
-  int exit_status;
-  char *tmpname;
+  gboolean disabled;
+  gboolean output_fd = FALSE;
 
   g_return_val_if_fail (uri != NULL, NULL);
   g_return_val_if_fail (mime_type != NULL, NULL);
@@ -1079,55 +1881,366 @@ mate_desktop_thumbnail_factory_generate_thumbnail (MateDesktopThumbnailFactory *
 
   script = NULL;
   g_mutex_lock (&factory->priv->lock);
-  if (!mate_desktop_thumbnail_factory_is_disabled (factory, mime_type))
+  disabled = mate_desktop_thumbnail_factory_is_disabled (factory, mime_type);
+  if (!disabled)
     {
       Thumbnailer *thumb;
 
       thumb = g_hash_table_lookup (factory->priv->mime_types_map, mime_type);
       if (thumb)
-        script = g_strdup (thumb->command);
+        {
+          script = g_strdup (thumb->command);
+          output_fd = thumb->output_fd;
+        }
     }
   g_mutex_unlock (&factory->priv->lock);
 
-  if (script)
+  if (!disabled && is_common_image_type (mime_type))
     {
-      int fd;
-
-      fd = g_file_open_tmp (".mate_desktop_thumbnail.XXXXXX", &tmpname, NULL);
+      pixbuf = get_image_thumbnail (uri, mime_type, size);
+      if (pixbuf != NULL)
+        {
+          g_free (script);
+          return pixbuf;
+        }
+    }
 
-      if (fd != -1)
+  if (script)
     {
-      char **expanded_script;
-      GError *error = NULL;
+      GBytes *output = NULL;
 
-      close (fd);
+      /* a thumbnailer that fails is not run a second time */
+      if (!output_fd || !run_thumbnailer_to_memory (script, size, uri, &output))
+        output = run_thumbnailer_to_file (script, size, uri);
 
-      expanded_script = expand_thumbnailing_script (script, size, uri, tmpname, &error);
-      if (expanded_script == NULL)
+      if (output != NULL)
         {
-          g_warning ("Failed to expand script '%s': %s", script, error->message);
-          g_error_free (error);
+          pixbuf = load_thumbnailer_output (output);
+          g_bytes_unref (output);
         }
+
+      g_free (script);
+    }
+
+  return pixbuf;
+}
+
+/* A caller waiting for a thumbnail. Whichever of the worker and the
+ * cancellation of the task gets to it first returns the task. */
+typedef struct {
+  GTask  *task;
+  gulong  cancelled_id;
+  gint    returned;
+} GenerateWaiter;
+
+/* All the callers waiting for the thumbnail of one uri */
+typedef struct {
+  char  *uri;
+  char  *mime_type;
+  gint   priority;
+  GList *waiters;
+} GenerateRequest;
+
+static gboolean
+generate_waiter_claim (GenerateWaiter *waiter)
+{
+  return g_atomic_int_compare_and_exchange (&waiter->returned, FALSE, TRUE);
+}
+
+static void
+generate_waiter_cancelled (GCancellable *cancellable,
+                           gpointer      user_data)
+{
+  GenerateWaiter *waiter = user_data;
+
+  if (generate_waiter_claim (waiter))
+    g_task_return_error_if_cancelled (waiter->task);
+}
+
+static GenerateWaiter *
+generate_waiter_new (GTask *task)
+{
+  GenerateWaiter *waiter;
+
+  waiter = g_slice_new0 (GenerateWaiter);
+  waiter->task = task;
+
+  if (g_task_get_cancellable (task) != NULL)
+    waiter->cancelled_id = g_cancellable_connect (g_task_get_cancellable (task),
+                                                  G_CALLBACK (generate_waiter_cancelled),
+                                                  waiter, NULL);
+
+  return waiter;
+}
+
+static void
+generate_waiter_free (GenerateWaiter *waiter)
+{
+  if (waiter->cancelled_id != 0)
+    g_cancellable_disconnect (g_task_get_cancellable (waiter->task),
+                              waiter->cancelled_id);
+  g_object_unref (waiter->task);
+  g_slice_free (GenerateWaiter, waiter);
+}
+
+static gboolean
+generate_waiter_free_cb (gpointer data)
+{
+  generate_waiter_free (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The tasks may hold the last references to the factory, which has to
+ * be finalized where it is used, not in its own thread pool: each
+ * waiter is freed in the main context of its task */
+static void
+generate_request_free (GenerateRequest *request)
+{
+  GList *l;
+
+  for (l = request->waiters; l != NULL; l = l->next)
+    {
+      GenerateWaiter *waiter = l->data;
+
+      g_main_context_invoke (g_task_get_context (waiter->task),
+                             generate_waiter_free_cb, waiter);
+    }
+
+  g_free (request->uri);
+  g_free (request->mime_type);
+  g_list_free (request->waiters);
+  g_slice_free (GenerateRequest, request);
+}
+
+static gint
+generate_request_compare (gconstpointer a,
+                          gconstpointer b,
+                          gpointer      user_data)
+{
+  gint priority_a = g_atomic_int_get (&((GenerateRequest *) a)->priority);
+  gint priority_b = g_atomic_int_get (&((GenerateRequest *) b)->priority);
+
+  return (priority_a > priority_b) - (priority_a < priority_b);
+}
+
+static gboolean
+generate_request_is_cancelled (GenerateRequest *request)
+{
+  GList *l;
+
+  for (l = request->waiters; l != NULL; l = l->next)
+    {
+      GenerateWaiter *waiter = l->data;
+
+      if (!g_atomic_int_get (&waiter->returned))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+generate_pool_worker (gpointer data,
+                      gpointer user_data)
+{
+  MateDesktopThumbnailFactory *factory = user_data;
+  GenerateRequest *request = data;
+  GdkPixbuf *pixbuf = NULL;
+  gboolean cancelled;
+  GList *l;
+
+  g_mutex_lock (&factory->priv->queue_lock);
+  cancelled = generate_request_is_cancelled (request);
+  g_mutex_unlock (&factory->priv->queue_lock);
+
+  if (!cancelled)
+    pixbuf = mate_desktop_thumbnail_factory_generate_thumbnail (factory,
+                                                                request->uri,
+                                                                request->mime_type);
+
+  /* later requests for the uri start over */
+  g_mutex_lock (&factory->priv->queue_lock);
+  g_hash_table_remove (factory->priv->generate_requests, request->uri);
+  g_mutex_unlock (&factory->priv->queue_lock);
+
+  /* cancelled tasks have already returned G_IO_ERROR_CANCELLED */
+  for (l = request->waiters; l != NULL; l = l->next)
+    {
+      GenerateWaiter *waiter = l->data;
+
+      if (!generate_waiter_claim (waiter))
+        continue;
+
+      if (pixbuf != NULL)
+        g_task_return_pointer (waiter->task, g_object_ref (pixbuf), g_object_unref);
       else
-        {
-          gboolean ret;
+        g_task_return_new_error (waiter->task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 "Could not generate a thumbnail for %s",
+                                 request->uri);
+    }
 
-          ret = g_spawn_sync (NULL, expanded_script, NULL, G_SPAWN_SEARCH_PATH,
-                              NULL, NULL, NULL, NULL, &exit_status, NULL);
-          if (ret && exit_status == 0)
-            pixbuf = gdk_pixbuf_new_from_file (tmpname, NULL);
+  if (pixbuf != NULL)
+    g_object_unref (pixbuf);
 
-          g_strfreev (expanded_script);
-        }
+  generate_request_free (request);
+}
+
+/**
+ * mate_desktop_thumbnail_factory_generate_thumbnail_async:
+ * @factory: a #MateDesktopThumbnailFactory
+ * @uri: the uri of a file
+ * @mime_type: the mime type of the file
+ * @priority: the priority of the request, lower values first
+ * @cancellable: (nullable): optional #GCancellable object, %NULL to ignore
+ * @callback: a #GAsyncReadyCallback to call when the thumbnail is ready
+ * @user_data: the data to pass to @callback
+ *
+ * Queues the generation of a thumbnail for the specified file, as
+ * mate_desktop_thumbnail_factory_generate_thumbnail() does. As many
+ * thumbnails as there are processors are generated at once, the
+ * others wait in order of @priority. Requests for a uri already in
+ * the queue share its result.
+ *
+ * @callback is called in the thread-default main context of the
+ * caller; call mate_desktop_thumbnail_factory_generate_thumbnail_finish()
+ * from it to get the thumbnail. If @cancellable is cancelled, @callback
+ * is called right away with %G_IO_ERROR_CANCELLED; the thumbnail is
+ * still generated if other callers wait for it.
+ *
+ * Since: 1.29
+ **/
+void
+mate_desktop_thumbnail_factory_generate_thumbnail_async (MateDesktopThumbnailFactory *factory,
+                                                         const char                  *uri,
+                                                         const char                  *mime_type,
+                                                         int                          priority,
+                                                         GCancellable                *cancellable,
+                                                         GAsyncReadyCallback          callback,
+                                                         gpointer                     user_data)
+{
+  MateDesktopThumbnailFactoryPrivate *priv;
+  GenerateRequest *request;
+  GenerateWaiter *waiter;
+  GTask *task;
+
+  g_return_if_fail (MATE_DESKTOP_IS_THUMBNAIL_FACTORY (factory));
+  g_return_if_fail (uri != NULL);
+  g_return_if_fail (mime_type != NULL);
+
+  priv = factory->priv;
 
-      g_unlink (tmpname);
-      g_free (tmpname);
+  task = g_task_new (factory, cancellable, callback, user_data);
+  g_task_set_source_tag (task, mate_desktop_thumbnail_factory_generate_thumbnail_async);
+  g_task_set_priority (task, priority);
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return;
     }
 
-      g_free (script);
+  /* returns G_IO_ERROR_CANCELLED as soon as @cancellable is cancelled */
+  waiter = generate_waiter_new (task);
+
+  g_mutex_lock (&priv->queue_lock);
+
+  if (priv->generate_pool == NULL)
+    {
+      priv->generate_pool = g_thread_pool_new (generate_pool_worker, factory,
+                                               g_get_num_processors (),
+                                               FALSE, NULL);
+      g_thread_pool_set_sort_function (priv->generate_pool,
+                                       generate_request_compare, NULL);
     }
 
-  return pixbuf;
+  request = g_hash_table_lookup (priv->generate_requests, uri);
+  if (request != NULL)
+    {
+      request->waiters = g_list_prepend (request->waiters, waiter);
+
+      /* the queue is kept sorted by the pool */
+      if (priority < g_atomic_int_get (&request->priority))
+        {
+          g_atomic_int_set (&request->priority, priority);
+          g_thread_pool_set_sort_function (priv->generate_pool,
+                                           generate_request_compare, NULL);
+        }
+    }
+  else
+    {
+      request = g_slice_new0 (GenerateRequest);
+      request->uri = g_strdup (uri);
+      request->mime_type = g_strdup (mime_type);
+      request->priority = priority;
+      request->waiters = g_list_prepend (NULL, waiter);
+
+      g_hash_table_insert (priv->generate_requests, request->uri, request);
+      g_thread_pool_push (priv->generate_pool, request, NULL);
+    }
+
+  g_mutex_unlock (&priv->queue_lock);
+}
+
+/**
+ * mate_desktop_thumbnail_factory_generate_thumbnail_finish:
+ * @factory: a #MateDesktopThumbnailFactory
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes an operation started with
+ * mate_desktop_thumbnail_factory_generate_thumbnail_async().
+ *
+ * Return value: (transfer full): thumbnail pixbuf if thumbnailing succeeded, %NULL otherwise.
+ *
+ * Since: 1.29
+ **/
+GdkPixbuf *
+mate_desktop_thumbnail_factory_generate_thumbnail_finish (MateDesktopThumbnailFactory *factory,
+                                                          GAsyncResult                *result,
+                                                          GError                     **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, factory), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * mate_desktop_thumbnail_factory_set_priority:
+ * @factory: a #MateDesktopThumbnailFactory
+ * @uri: the uri of a file
+ * @priority: the new priority of the request, lower values first
+ *
+ * Changes the priority of the queued request for the thumbnail of @uri,
+ * for instance when the file becomes visible. Does nothing if there is
+ * none, or if it is already being generated.
+ *
+ * Since: 1.29
+ **/
+void
+mate_desktop_thumbnail_factory_set_priority (MateDesktopThumbnailFactory *factory,
+                                             const char                  *uri,
+                                             int                          priority)
+{
+  MateDesktopThumbnailFactoryPrivate *priv;
+  GenerateRequest *request;
+
+  g_return_if_fail (MATE_DESKTOP_IS_THUMBNAIL_FACTORY (factory));
+  g_return_if_fail (uri != NULL);
+
+  priv = factory->priv;
+
+  g_mutex_lock (&priv->queue_lock);
+
+  request = g_hash_table_lookup (priv->generate_requests, uri);
+  if (request != NULL && g_atomic_int_get (&request->priority) != priority)
+    {
+      g_atomic_int_set (&request->priority, priority);
+      g_thread_pool_set_sort_function (priv->generate_pool,
+                                       generate_request_compare, NULL);
+    }
+
+  g_mutex_unlock (&priv->queue_lock);
 }
 
 static gboolean
@@ -1335,18 +2448,9 @@ mate_desktop_thumbnail_is_valid (GdkPixbuf          *pixbuf,
                                  time_t              mtime)
 {
   const char *thumb_uri, *thumb_mtime_str;
-  time_t thumb_mtime;
 
   thumb_uri = gdk_pixbuf_get_option (pixbuf, "tEXt::Thumb::URI");
-  if (g_strcmp0 (uri, thumb_uri) != 0)
-    return FALSE;
-
   thumb_mtime_str = gdk_pixbuf_get_option (pixbuf, "tEXt::Thumb::MTime");
-  if (!thumb_mtime_str)
-    return FALSE;
-  thumb_mtime = (time_t)g_ascii_strtoll (thumb_mtime_str, (gchar**)NULL, 10);
-  if (mtime != thumb_mtime)
-    return FALSE;
 
-  return TRUE;
+  return thumbnail_text_is_valid (thumb_uri, thumb_mtime_str, uri, mtime);
 }
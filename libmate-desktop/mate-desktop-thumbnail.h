@@ -32,6 +32,7 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <gio/gio.h>
 #include <time.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
@@ -68,6 +69,10 @@ MateDesktopThumbnailFactory *mate_desktop_thumbnail_factory_new      (MateDeskto
 char *     mate_desktop_thumbnail_factory_lookup   (MateDesktopThumbnailFactory *factory,
                                                     const char                  *uri,
                                                     time_t                       mtime);
+char **    mate_desktop_thumbnail_factory_lookup_many (MateDesktopThumbnailFactory *factory,
+                                                       const char * const          *uris,
+                                                       const time_t                *mtimes,
+                                                       guint                        n_files);
 
 gboolean   mate_desktop_thumbnail_factory_has_valid_failed_thumbnail (MateDesktopThumbnailFactory *factory,
                                                                       const char                  *uri,
@@ -79,6 +84,19 @@ gboolean   mate_desktop_thumbnail_factory_can_thumbnail (MateDesktopThumbnailFac
 GdkPixbuf *  mate_desktop_thumbnail_factory_generate_thumbnail (MateDesktopThumbnailFactory *factory,
                                                                 const char                  *uri,
                                                                 const char                  *mime_type);
+void       mate_desktop_thumbnail_factory_generate_thumbnail_async (MateDesktopThumbnailFactory *factory,
+                                                                    const char                  *uri,
+                                                                    const char                  *mime_type,
+                                                                    int                          priority,
+                                                                    GCancellable                *cancellable,
+                                                                    GAsyncReadyCallback          callback,
+                                                                    gpointer                     user_data);
+GdkPixbuf *  mate_desktop_thumbnail_factory_generate_thumbnail_finish (MateDesktopThumbnailFactory *factory,
+                                                                       GAsyncResult                *result,
+                                                                       GError                     **error);
+void       mate_desktop_thumbnail_factory_set_priority (MateDesktopThumbnailFactory *factory,
+                                                        const char                  *uri,
+                                                        int                          priority);
 void       mate_desktop_thumbnail_factory_save_thumbnail (MateDesktopThumbnailFactory *factory,
                                                           GdkPixbuf                   *thumbnail,
                                                           const char                  *uri,